@@ -47,6 +47,8 @@ class LedClient : public LedClientBase {
 
     SocketStatus connectTo(const std::string&,
                            uint16_t port) noexcept;
+    SocketStatus connectUnix(const std::string& path,
+                             bool shared_memory = false) noexcept;
     virtual SocketStatus disconnect() override;
     void setHandler(handler_function_t handler);
     virtual SocketStatus getStatus() const override {
@@ -19,6 +19,7 @@
 #include <thread>
 #include <condition_variable>
 #include <atomic>
+#include <memory>
 
 namespace mega_camera {
 
@@ -29,6 +30,8 @@ typedef struct sockaddr_in SocketAddr_in;
 typedef int Socket;
 typedef int ka_prop_t;
 typedef std::vector<uint8_t> DataBuffer;
+//! Неизменяемый закодированный кадр (длина и данные), разделяемый между отправками.
+typedef std::shared_ptr<const DataBuffer> SharedFrame;
 
 //! Keep alive настройки.
 struct KeepAliveConfig {
@@ -58,6 +61,8 @@ enum class SocketType : uint8_t {
     server_socket
 };
 
+class ShmChannel;
+
 //! Базовый класс клиента и сервера.
 struct LedClientBase {
     typedef SocketStatus status;
@@ -67,12 +72,16 @@ struct LedClientBase {
     virtual SocketType getType() const = 0;
     DataBuffer loadData();
     bool sendData(std::string) const noexcept;
+    bool sendFrame(const DataBuffer& frame) const noexcept;
+    static SharedFrame encodeFrame(const std::string& str);
     LedClientBase(): _socket(-1),
-        _status(SocketStatus::close) {}
+        _status(SocketStatus::close), shm() {}
 
   protected:
     Socket _socket;
     std::atomic<SocketStatus> _status;
+    //! Канал в разделяемой памяти, если сообщения идут через него, а не через сокет.
+    std::shared_ptr<ShmChannel> shm;
 };
 
 }
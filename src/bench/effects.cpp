@@ -0,0 +1,52 @@
+/*!
+ * \brief Замер производительности движка эффектов.
+ *
+ * Для каждого числа устройств тики выполняются подряд в течение заданного времени,
+ * выводится число тиков в секунду и время на одно устройство.
+*/
+#include "effects.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+using namespace mega_camera;
+
+int main(int argc, char** argv) {
+    static const size_t COUNTS[] = { 256, 1024, 4096, 16384, 65536, 262144 };
+    static const LedEffect MIX[] = { NONE, BLINK, FADE, CHASE };
+    double duration = argc > 1 ? std::atof(argv[1]) : 0.5;
+
+    std::cout << std::setw(10) << "leds" << std::setw(16) << "ticks/s"
+              << std::setw(14) << "ns/led" << std::endl;
+
+    for (size_t count : COUNTS) {
+        EffectsEngine engine(count);
+        for (size_t i = 0; i < count; ++i) {
+            Led led = LED_DEFAULT;
+            led.effect = MIX[i % 4];
+            led.rate = static_cast<LedRate>(i % 6);
+            engine.configure(i, led);
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        auto deadline = begin + std::chrono::duration<double>(duration);
+        uint64_t ticks = 0;
+        do {
+            for (int i = 0; i < 16; ++i)
+                engine.tick(1.0f / EFFECTS_TICK_RATE);
+            ticks += 16;
+        } while (std::chrono::steady_clock::now() < deadline);
+        double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin).count();
+
+        std::cout << std::setw(10) << count
+                  << std::setw(16) << std::fixed << std::setprecision(0)
+                  << static_cast<double>(ticks) / elapsed
+                  << std::setw(14) << std::setprecision(2)
+                  << elapsed * 1e9 / static_cast<double>(ticks * count) << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
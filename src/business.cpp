@@ -2,179 +2,686 @@
  * \brief Тестовая бизнес логика.
 */
 #include "server_base.h"
-#include <iostream>
+#include "led_state.h"
+#include "journal.h"
+#include "effects.h"
+#include "trace.h"
+#include "logger.h"
+
+#include <array>
 #include <map>
+#include <string_view>
 
 using namespace mega_camera;
 
-//! Состояние светодиода
-typedef enum LedState : uint8_t {
-    ON = 0
-  , OFF = 1
-} LedState;
-
-//! Цвет светодиода
-typedef enum LedColor : uint8_t {
-    RED = 0
-  , GREEN = 1
-  , BLUE = 2
-} LedColor;
-
-typedef uint8_t LedRate;
-typedef std::string (*HandlerFuncPtr)(std::string);
-
-typedef struct Led {
-    enum LedState state;
-    enum LedColor color;
-    LedRate rate;
-} Led;
-
-static Led target = { ON, RED, 4 };
-static std::mutex cons_mutex;
-
-std::string set_led_state(std::string);
-std::string get_led_state(std::string);
-std::string set_led_color(std::string);
-std::string get_led_color(std::string);
-std::string set_led_rate(std::string);
-std::string get_led_rate(std::string);
+typedef std::string (*HandlerFuncPtr)(std::string, uint64_t&);
+
+//! Таблица устройств. Команды без номера устройства обращаются к записи 0.
+static LedStateStore store;
+//! Журнал изменяющих команд.
+static Journal journal;
+//! Изменения для ведомых серверов.
+static ReplicationLog replication;
+//! Эффекты, вычисляемые сервером.
+static EffectsEngine effects;
+//! Идет повтор журнала, состояние не выводится.
+static bool replaying = false;
+//! Файл выгрузки трассировки, пустой - трассировка недоступна.
+static std::string trace_path;
+static ProfiledMutex cons_mutex("business.cons");
+
+std::string set_led_state(std::string, uint64_t&);
+std::string set_led_color(std::string, uint64_t&);
+std::string set_led_rate(std::string, uint64_t&);
+std::string set_led_effect(std::string, uint64_t&);
+std::string get_led_level(std::string, uint64_t&);
+std::string trace_on(std::string, uint64_t&);
+std::string trace_off(std::string, uint64_t&);
+std::string trace_dump(std::string, uint64_t&);
+std::string lock_profile(std::string, uint64_t&);
+std::string lock_profile_reset(std::string, uint64_t&);
 
 void print_screen(void);
 
 //! Обработчики
 static std::map<std::string, HandlerFuncPtr> const CMD = {
     { "set-led-state", set_led_state }
-  , { "get-led-state", get_led_state }
   , { "set-led-color", set_led_color }
-  , { "get-led-color", get_led_color }
   , { "set-led-rate",  set_led_rate }
-  , { "get-led-rate",  get_led_rate }
+  , { "set-led-effect", set_led_effect }
+  , { "get-led-level", get_led_level }
+  , { "trace-on",      trace_on }
+  , { "trace-off",     trace_off }
+  , { "trace-dump",    trace_dump }
+  , { "lock-profile",  lock_profile }
+  , { "lock-profile-reset", lock_profile_reset }
 };
 
+//! Имена значений в командах и ответах.
+static const char* const STATE_NAMES[] = { "on", "off" };
+static const char* const COLOR_NAMES[] = { "red", "green", "blue" };
+static const char* const EFFECT_NAMES[] = { "none", "blink", "fade", "chase" };
+
+/*!
+ * \brief Имя значения из таблицы.
+ *
+ * Состояние в отображаемом файле не проверяется, поэтому значение может выходить
+ * за таблицу.
+ *
+ * \param[in] unknown Имя значения вне таблицы.
+ * \return Имя.
+*/
+template<size_t N>
+static const char* value_name(const char* const (&names)[N], size_t value,
+                              const char* unknown = nullptr) {
+    return value < N ? names[value] : unknown;
+}
+
+//! Виды кэшируемых ответов.
+enum ReplyKind : uint8_t {
+    REPLY_STATE = 0
+  , REPLY_COLOR
+  , REPLY_RATE
+  , REPLY_EFFECT
+  , REPLY_KINDS
+};
+
+//! Запросы, ответы на которые берутся из кэша.
+static std::map<std::string, ReplyKind, std::less<>> const QUERY = {
+    { "get-led-state", REPLY_STATE }
+  , { "get-led-color", REPLY_COLOR }
+  , { "get-led-rate",  REPLY_RATE }
+  , { "get-led-effect", REPLY_EFFECT }
+};
+
+/*!
+ * \brief Кэш ответов на get-*.
+ *
+ * Ответы хранятся готовыми кадрами и пересобираются только при изменении устройства,
+ * запрос отдает кадр на отправку без форматирования и выделения памяти. Кэш помечен
+ * версией состояния, при расхождении (открытие файла, состояние от предшественника)
+ * он пересобирается целиком. Доступ под cons_mutex.
+*/
+static std::array<std::array<SharedFrame, REPLY_KINDS>, LED_MAX_DEVICES> replies;
+static uint64_t replies_generation = UINT64_MAX;
+static const SharedFrame FAILED_FRAME = LedClientBase::encodeFrame("FAILED\n");
+
+static SharedFrame query_reply(ReplyKind kind, std::string_view args);
+
 
 void LedServer::server_business(DataBuffer data,
                                 LedServer::Client& client) {
+    if (streamBusiness(data, client))
+        return;
+
     std::string rc;
-    std::string input(reinterpret_cast<char*>
-                      (data.data()), 0, data.size());
+    std::string_view request(reinterpret_cast<const char*>(data.data()), data.size());
+    size_t end = request.find_first_of(" \n");
+
+    // Запросы чтения обслуживаются из кэша без разбора в std::string, в том числе
+    // ведомым сервером
+    auto query = QUERY.find(request.substr(0, end));
+    if (query != QUERY.end()) {
+        std::string_view args = end == std::string_view::npos
+            ? std::string_view() : request.substr(end + 1);
+        SharedFrame reply = query_reply((*query).second, args);
+        TraceScope send_span("send");
+        client.sendFrame(*reply);
+        return;
+    }
+
+    std::string input(request);
+    if (replicationBusiness(input, client))
+        return;
+
     size_t com = input.find_first_of(" \n\0");
 
     auto it = CMD.find(input.substr(0, com));
     if (it == CMD.end()) {
-        // TODO: make a warning
+        // Ответ нужен всегда: ведомый сопоставляет ответы пересланным командам по порядку
+        client.sendData("FAILED\n");
         return;
     }
 
+    uint64_t ticket = 0;
     if (com != std::string::npos)
-        rc = (*it).second(input.substr(com + 1));
+        rc = (*it).second(input.substr(com + 1), ticket);
     else
-        rc = (*it).second("");
+        rc = (*it).second("", ticket);
+
+    // Ответ на изменяющую команду уходит только после записи журнала на диск
+    {
+        TraceScope journal_span("journal");
+        if (not journal.waitDurable(ticket))
+            rc = "FAILED\n";
+    }
 
+    TraceScope send_span("send");
     client.sendData(rc);
 };
 
 
-std::string set_led_state(std::string args) {
+/*!
+ * \brief Проверка, что первое слово строки - известная команда.
+*/
+bool LedServer::isCommand(const std::string& input) {
+    return CMD.count(input.substr(0, input.find_first_of(" \n"))) != 0;
+}
+
+
+/*!
+ * \brief Применение обновления без ответа.
+ *
+ * Используется быстрым путем UDP: принимаются только команды set-*, запись журнала
+ * не ожидается.
+ *
+ * \param[in] input Команда.
+ * \return Команда применена.
+*/
+bool LedServer::applyUpdate(const std::string& input) {
+    size_t com = input.find_first_of(" \n");
+    // Ведомый меняет состояние только по изменениям от ведущего
+    if (com == std::string::npos || input.compare(0, 4, "set-") != 0 ||
+            not primary_host.empty())
+        return false;
+
+    auto it = CMD.find(input.substr(0, com));
+    if (it == CMD.end())
+        return false;
+
+    uint64_t ticket = 0;
+    return (*it).second(input.substr(com + 1), ticket) == "OK\n";
+}
+
+
+/*!
+ * \brief Настройка эффектов всех устройств по таблице. Вызывается под cons_mutex.
+*/
+static void configure_effects() {
+    for (uint32_t i = 0; i < LED_MAX_DEVICES; ++i)
+        effects.configure(i, store.device(i));
+}
+
+
+/*!
+ * \brief Открытие файла состояния.
+ *
+ * \param[in] path Путь к файлу.
+ * \param[in] sync_interval Период msync, 0 - только явный syncState().
+ * \return Статус операции.
+*/
+bool LedServer::openState(const std::string& path,
+                          std::chrono::milliseconds sync_interval) {
+    bool restored;
+    {
+        std::lock_guard lock(cons_mutex);
+        if (not store.open(path, restored))
+            return false;
+        configure_effects();
+    }
+    if (sync_interval.count() > 0)
+        store.startPeriodicSync(sync_interval);
+    return true;
+}
+
+
+/*!
+ * \brief Запуск движка эффектов.
+ *
+ * \param[in] tick_rate Частота тиков, Гц.
+ * \return Статус операции.
+*/
+bool LedServer::startEffects(uint tick_rate) {
+    {
+        std::lock_guard lock(cons_mutex);
+        configure_effects();
+    }
+    return effects.start(tick_rate);
+}
+
+
+void LedServer::stopEffects() {
+    effects.stop();
+}
+
+
+/*!
+ * \brief Настройка трассировки запросов.
+ *
+ * Команды trace-on и trace-off включают и выключают запись участков, trace-dump
+ * выгружает их в path. Вызывается до start().
+ *
+ * \param[in] path Файл выгрузки в формате Chrome trace event JSON.
+ * \param[in] enabled Включить запись сразу.
+ * \return false, если сервер собран без LEDCTRL_TRACING.
+*/
+bool LedServer::setTracing(const std::string& path, bool enabled) {
+#ifdef LEDCTRL_TRACING
+    trace_path = path;
+    mega_camera::setTracing(enabled);
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+/*!
+ * \brief Явный сброс состояния на диск.
+*/
+bool LedServer::syncState() {
+    return store.sync();
+}
+
+
+/*!
+ * \brief Сериализация таблицы устройств. Вызывается под cons_mutex.
+ *
+ * Формат: число устройств (uint32_t), затем записи Led.
+*/
+static DataBuffer export_state() {
+    uint32_t count = store.state().count;
+    DataBuffer data(sizeof(count) + count * sizeof(Led));
+    memcpy(data.data(), &count, sizeof(count));
+    memcpy(data.data() + sizeof(count), &store.device(0), count * sizeof(Led));
+    return data;
+}
+
+
+/*!
+ * \brief Сериализация состояния для передачи преемнику.
+*/
+DataBuffer LedServer::exportState() {
     std::lock_guard lock(cons_mutex);
-    args = args.substr(0, args.find_first_of("\n"));
-    if (args == "off") target.state = OFF;
-    else if (args == "on") target.state = ON;
-    else return "FAILED\n";
+    return export_state();
+}
+
+
+/*!
+ * \brief Журнал изменений для ведомых.
+*/
+ReplicationLog& LedServer::replicationLog() {
+    return replication;
+}
+
+
+/*!
+ * \brief Снимок состояния для ведомого в формате exportState().
+ *
+ * \param[out] seq Номер последнего изменения, вошедшего в снимок.
+*/
+std::string LedServer::replicationSnapshot(uint64_t& seq) {
+    std::lock_guard lock(cons_mutex);
+    seq = replication.lastSeq();
+    DataBuffer data = export_state();
+    return std::string(data.begin(), data.end());
+}
+
+
+/*!
+ * \brief Применение канонической команды от ведущего.
+*/
+bool LedServer::applyReplicated(const std::string& command) {
+    size_t com = command.find_first_of(" ");
+    if (com == std::string::npos)
+        return false;
+
+    auto it = CMD.find(command.substr(0, com));
+    if (it == CMD.end())
+        return false;
+
+    uint64_t ticket = 0;
+    return (*it).second(command.substr(com + 1), ticket) == "OK\n";
+}
+
+
+/*!
+ * \brief Восстановление состояния, полученного от предшественника.
+*/
+bool LedServer::importState(const DataBuffer& data) {
+    uint32_t count;
+
+    if (data.size() < sizeof(count))
+        return false;
+    memcpy(&count, data.data(), sizeof(count));
+    if (count < 1 || count > LED_MAX_DEVICES ||
+            data.size() != sizeof(count) + count * sizeof(Led))
+        return false;
+
+    std::lock_guard lock(cons_mutex);
+    memcpy(&store.device(0), data.data() + sizeof(count), count * sizeof(Led));
+    store.state().count = count;
+    ++store.state().generation;
+    configure_effects();
+    return true;
+}
+
+
+/*!
+ * \brief Выбор устройства.
+ *
+ * Аргументы могут начинаться с номера устройства вида "#2". Номер отрезается от
+ * аргументов, без номера выбирается устройство 0. Вызывается под cons_mutex.
+ *
+ * \param[in,out] args Аргументы команды без завершающего перевода строки.
+ * \param[in] any Разрешить устройства за пределами таблицы (для set-*).
+ * \return Устройство или nullptr.
+*/
+static Led* select_device(std::string& args, bool any) {
+    size_t index = 0;
+
+    if (not args.empty() && args[0] == '#') {
+        size_t end = args.find_first_of(" ");
+        char* tail = nullptr;
+        std::string number = args.substr(1, end == std::string::npos ? end : end - 1);
+        unsigned long value = std::strtoul(number.c_str(), &tail, 10);
+        if (number.empty() || *tail != '\0' || value >= LED_MAX_DEVICES)
+            return nullptr;
+        index = value;
+        args = end == std::string::npos ? "" : args.substr(end + 1);
+    }
+
+    if (index >= store.state().count && not any)
+        return nullptr;
+    return &store.device(index);
+}
+
+
+/*!
+ * \brief Пересборка кэшированных ответов устройства. Вызывается под cons_mutex.
+*/
+static void rebuild_replies(size_t index) {
+    const Led& led = store.device(index);
+    auto& frames = replies[index];
+    auto name = [](const char* const* names, size_t count, size_t value) {
+        return value < count ? std::string("OK ") + names[value] + "\n"
+               : std::string("FAILED\n");
+    };
+
+    frames[REPLY_STATE] = LedClientBase::encodeFrame(name(STATE_NAMES, 2, led.state));
+    frames[REPLY_COLOR] = LedClientBase::encodeFrame(name(COLOR_NAMES, 3, led.color));
+    frames[REPLY_RATE] = LedClientBase::encodeFrame(
+        "OK " + std::to_string(static_cast<int>(led.rate)) + "\n");
+    frames[REPLY_EFFECT] = LedClientBase::encodeFrame(name(EFFECT_NAMES, 4, led.effect));
+}
+
+
+/*!
+ * \brief Ответ на запрос чтения из кэша.
+ *
+ * Аргументы могут начинаться с номера устройства вида "#2", как в select_device().
+ *
+ * \param[in] kind Вид ответа.
+ * \param[in] args Аргументы запроса.
+ * \return Кадр ответа.
+*/
+static SharedFrame query_reply(ReplyKind kind, std::string_view args) {
+    size_t index = 0;
+
+    if (not args.empty() && args[0] == '#') {
+        std::string_view number = args.substr(1, args.find_first_of(" \n") - 1);
+        if (number.empty() || number.size() > 3)
+            return FAILED_FRAME;
+        for (char digit : number) {
+            if (digit < '0' || digit > '9')
+                return FAILED_FRAME;
+            index = index * 10 + static_cast<size_t>(digit - '0');
+        }
+    }
+
+    std::lock_guard lock(cons_mutex);
+    if (index >= store.state().count)
+        return FAILED_FRAME;
+    if (replies_generation != store.state().generation) {
+        for (size_t i = 0; i < LED_MAX_DEVICES; ++i)
+            rebuild_replies(i);
+        replies_generation = store.state().generation;
+    }
+    return replies[index][kind];
+}
+
+
+/*!
+ * \brief Фиксация изменения устройства.
+ *
+ * Если значение не изменилось, версия состояния и кэш ответов остаются прежними, а
+ * вызывающий ждет только уже поставленные записи журнала. Иначе таблица расширяется
+ * до измененного устройства, номер версии состояния увеличивается, ответы устройства
+ * пересобираются и в журнал ставится каноническая команда. Вызывается под
+ * cons_mutex, поэтому порядок записей в журнале совпадает с порядком изменений.
+ *
+ * \param[in,out] led Устройство.
+ * \param[in] next Новое состояние устройства.
+ * \param[in] command Команда.
+ * \param[in] value Новое значение.
+ * \return Номер записи журнала.
+*/
+static uint64_t commit_device(Led* led, const Led& next, const char* command,
+                              const std::string& value) {
+    LedStateHeader& header = store.state();
+    uint32_t index = static_cast<uint32_t>(led - &store.device(0));
+    if (index < header.count && memcmp(led, &next, sizeof(Led)) == 0)
+        return replaying ? 0 : journal.lastTicket();
+
+    bool replies_current = replies_generation == header.generation;
+    *led = next;
+    if (index >= header.count)
+        header.count = index + 1;
+    ++header.generation;
+    effects.configure(index, *led);
+    if (replies_current) {
+        rebuild_replies(index);
+        replies_generation = header.generation;
+    }
+
+    if (replaying)
+        return 0;
     LedServer::print_screen();
-    return "OK\n";
+    std::string record = std::string(command) + " #" + std::to_string(index) + " " + value;
+    replication.append(record);
+    return journal.append(std::move(record));
 }
 
 
-std::string get_led_state(std::string args) {
+/*!
+ * \brief Снимок состояния в виде канонических команд.
+*/
+static std::vector<std::string> snapshot_commands() {
+    std::vector<std::string> records;
+
     std::lock_guard lock(cons_mutex);
-    switch (target.state) {
-    case ON:
-        return "OK on\n";
-    case OFF:
-        return "OK off\n";
-    default:
-        break;
+    for (uint32_t i = 0; i < store.state().count; ++i) {
+        const Led& led = store.device(i);
+        std::string device = " #" + std::to_string(i) + " ";
+        const char* state = value_name(STATE_NAMES, led.state);
+        const char* color = value_name(COLOR_NAMES, led.color);
+        const char* effect = value_name(EFFECT_NAMES, led.effect);
+        // Поврежденное значение в снимок не попадает, при повторе остается исходное
+        if (state)
+            records.push_back("set-led-state" + device + state);
+        if (color)
+            records.push_back("set-led-color" + device + color);
+        records.push_back("set-led-rate" + device + std::to_string(static_cast<int>(led.rate)));
+        if (effect)
+            records.push_back("set-led-effect" + device + effect);
     }
-    return "FAILED\n";
+    return records;
+}
+
+
+/*!
+ * \brief Открытие журнала.
+ *
+ * Журнал повторяется поверх текущего состояния и сжимается в снимок.
+ *
+ * \param[in] path Путь к файлу журнала.
+ * \param[in] replay Повторить записи. Без повтора журнал заменяется снимком текущего
+ * состояния, например принятого от предшественника.
+ * \return Статус операции.
+*/
+bool LedServer::openJournal(const std::string& path, bool replay) {
+    return journal.open(path,
+        [replay](const std::string& record) {
+            if (not replay)
+                return;
+            size_t com = record.find_first_of(" ");
+            auto it = CMD.find(record.substr(0, com));
+            uint64_t ticket = 0;
+            if (it == CMD.end() || com == std::string::npos)
+                return;
+            replaying = true;
+            (*it).second(record.substr(com + 1), ticket);
+            replaying = false;
+        },
+        snapshot_commands
+    );
+}
+
+
+/*!
+ * \brief Явное сжатие журнала в снимок.
+*/
+bool LedServer::compactJournal() {
+    return journal.compact();
 }
 
 
-std::string set_led_color(std::string args) {
+/*!
+ * \brief Повторное открытие журнала по тому же пути, без повтора записей.
+ *
+ * Вызывается, когда команды не обрабатываются. Журнал сжимается в снимок текущего
+ * состояния в новый файл.
+ *
+ * \return Статус операции, true если журнал не был открыт.
+*/
+bool LedServer::reopenJournal() {
+    std::string path = journal.openedPath();
+    if (path.empty())
+        return true;
+    journal.close();
+    return openJournal(path, false);
+}
+
+
+std::string set_led_state(std::string args, uint64_t& ticket) {
     std::lock_guard lock(cons_mutex);
     args = args.substr(0, args.find_first_of("\n"));
-    if (args == "green") target.color = GREEN;
-    else if (args == "red") target.color = RED;
-    else if (args == "blue") target.color = BLUE;
+    Led* led = select_device(args, true);
+    if (not led) return "FAILED\n";
+    Led next = *led;
+    if (args == "off") next.state = OFF;
+    else if (args == "on") next.state = ON;
     else return "FAILED\n";
-    LedServer::print_screen();
+    ticket = commit_device(led, next, "set-led-state", args);
     return "OK\n";
 }
 
 
-std::string get_led_color(std::string args) {
+std::string set_led_color(std::string args, uint64_t& ticket) {
     std::lock_guard lock(cons_mutex);
-    switch (target.color) {
-    case RED:
-        return "OK red\n";
-    case GREEN:
-        return "OK green\n";
-    case BLUE:
-        return "OK blue\n";
-    default:
-        break;
-    }
-    return "FAILED\n";
+    args = args.substr(0, args.find_first_of("\n"));
+    Led* led = select_device(args, true);
+    if (not led) return "FAILED\n";
+    Led next = *led;
+    if (args == "green") next.color = GREEN;
+    else if (args == "red") next.color = RED;
+    else if (args == "blue") next.color = BLUE;
+    else return "FAILED\n";
+    ticket = commit_device(led, next, "set-led-color", args);
+    return "OK\n";
 }
 
 
-std::string set_led_rate(std::string args) {
+std::string set_led_rate(std::string args, uint64_t& ticket) {
     std::lock_guard lock(cons_mutex);
     args = args.substr(0, args.find_first_of("\n"));
+    Led* led = select_device(args, true);
+    if (not led) return "FAILED\n";
+    Led next = *led;
     auto val = std::atoi(args.c_str());
-    if (val >= 0 && val <= 5) target.rate = val;
+    if (val >= 0 && val <= 5) next.rate = static_cast<LedRate>(val);
     else return "FAILED\n";
-    LedServer::print_screen();
+    ticket = commit_device(led, next, "set-led-rate", std::to_string(val));
+    return "OK\n";
+}
+
+
+std::string set_led_effect(std::string args, uint64_t& ticket) {
+    std::lock_guard lock(cons_mutex);
+    args = args.substr(0, args.find_first_of("\n"));
+    Led* led = select_device(args, true);
+    if (not led) return "FAILED\n";
+    Led next = *led;
+    if (args == "none") next.effect = NONE;
+    else if (args == "blink") next.effect = BLINK;
+    else if (args == "fade") next.effect = FADE;
+    else if (args == "chase") next.effect = CHASE;
+    else return "FAILED\n";
+    ticket = commit_device(led, next, "set-led-effect", args);
     return "OK\n";
 }
 
 
-std::string get_led_rate(std::string args) {
+/*!
+ * \brief Текущая яркость устройства (0-255) по последнему тику эффектов.
+*/
+std::string get_led_level(std::string args, uint64_t& ticket) {
     std::lock_guard lock(cons_mutex);
-    char buf[100];
-    std::snprintf(buf, sizeof(buf), "OK %u\n",
-                  target.rate);
-    return std::string(buf);
+    args = args.substr(0, args.find_first_of("\n"));
+    Led* led = select_device(args, false);
+    if (not led) return "FAILED\n";
+    return "OK " + std::to_string(
+               static_cast<int>(effects.level(static_cast<size_t>(led - &store.device(0))))) +
+           "\n";
 }
 
+std::string trace_on(std::string args, uint64_t& ticket) {
+    if (trace_path.empty()) return "FAILED\n";
+    setTracing(true);
+    return "OK\n";
+}
+
+
+std::string trace_off(std::string args, uint64_t& ticket) {
+    if (trace_path.empty()) return "FAILED\n";
+    setTracing(false);
+    return "OK\n";
+}
+
+
+std::string trace_dump(std::string args, uint64_t& ticket) {
+    if (trace_path.empty() || not traceDump(trace_path)) return "FAILED\n";
+    return "OK\n";
+}
+
+
+std::string lock_profile(std::string args, uint64_t& ticket) {
+#ifdef LEDCTRL_LOCK_PROFILING
+    return "OK\n" + lockProfileReport();
+#else
+    return "FAILED\n";
+#endif
+}
+
+
+std::string lock_profile_reset(std::string args, uint64_t& ticket) {
+#ifdef LEDCTRL_LOCK_PROFILING
+    lockProfileReset();
+    return "OK\n";
+#else
+    return "FAILED\n";
+#endif
+}
+
+/*!
+ * \brief Вывод состояния устройства 0 в журнал.
+*/
 void LedServer::print_screen(void) {
-    system("clear");
-    std::cout << "State: ";
-    switch (target.state) {
-    case ON:
-        std::cout << "ON";
-        break;
-    case OFF:
-        std::cout << "OFF";
-        break;
-    default:
-        break;
-    }
-    std::cout << std::endl;
-    std::cout << "Color: ";
-    switch (target.color) {
-    case RED:
-        std::cout << "RED";
-        break;
-    case GREEN:
-        std::cout << "GREEN";
-        break;
-    case BLUE:
-        std::cout << "BLUE";
-        break;
-    default:
-        break;
-    }
-    std::cout << std::endl;
-    std::cout << "Rate:  " << std::to_string(
-                  static_cast<int>(target.rate)) << std::endl;
+    const Led& target = store.device(0);
+    logInfo("LED", {}, {
+        { "state", value_name(STATE_NAMES, target.state, "?") },
+        { "color", value_name(COLOR_NAMES, target.color, "?") },
+        { "rate", target.rate },
+        { "effect", value_name(EFFECT_NAMES, target.effect, "?") }
+    });
 }
@@ -0,0 +1,185 @@
+/*!
+ * \brief Реализация записи трафика.
+*/
+#include "capture.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+
+using namespace mega_camera;
+
+/*!
+ * \brief Запись буфера целиком.
+*/
+static bool writeAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t answ = write(fd, data.data() + done, data.size() - done);
+        if (answ < 0 && errno == EINTR)
+            continue;
+        if (answ <= 0)
+            return false;
+        done += static_cast<size_t>(answ);
+    }
+    return true;
+}
+
+TrafficCapture::TrafficCapture()
+    : fd(-1)
+    , origin()
+    , buffer()
+    , writer()
+    , mtx()
+    , flush_condition()
+    , active(false)
+    , terminated(false)
+    , dropped_count(0)
+{}
+
+TrafficCapture::~TrafficCapture() {
+    close();
+}
+
+/*!
+ * \brief Начало записи.
+ *
+ * \param[in] path Путь к файлу, существующий файл перезаписывается.
+ * \return Статус операции.
+*/
+bool TrafficCapture::open(const std::string& path) {
+    if (fd != -1 || writer.joinable())
+        return false;
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+
+    CaptureFileHeader header = {
+        CAPTURE_MAGIC, CAPTURE_VERSION, sizeof(CaptureRecordHeader)
+    };
+    {
+        std::lock_guard lock(mtx);
+        buffer.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+        origin = std::chrono::steady_clock::now();
+        terminated = false;
+    }
+    dropped_count = 0;
+    writer = std::thread(&TrafficCapture::writerLoop, this);
+    active = true;
+    return true;
+}
+
+/*!
+ * \brief Остановка записи, накопленные кадры дописываются в файл.
+*/
+void TrafficCapture::close() {
+    active = false;
+    {
+        std::lock_guard lock(mtx);
+        terminated = true;
+    }
+    flush_condition.notify_one();
+    if (writer.joinable())
+        writer.join();
+    if (fd != -1)
+        ::close(fd);
+    fd = -1;
+}
+
+void TrafficCapture::append(uint32_t connection, const DataBuffer& data) {
+    const auto now = std::chrono::steady_clock::now();
+    bool flush;
+    {
+        std::lock_guard lock(mtx);
+        if (not active || buffer.size() > CAPTURE_MAX_BUFFER) {
+            ++dropped_count;
+            return;
+        }
+        CaptureRecordHeader header = {
+            static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                      now - origin).count()),
+            connection,
+            static_cast<uint32_t>(data.size())
+        };
+        buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        buffer.append(reinterpret_cast<const char*>(data.data()), data.size());
+        flush = buffer.size() >= CAPTURE_FLUSH_SIZE;
+    }
+    if (flush)
+        flush_condition.notify_one();
+}
+
+/*!
+ * \brief Поток записи в файл.
+ *
+ * Буфер забирается целиком под мьютексом и пишется без него.
+*/
+void TrafficCapture::writerLoop() {
+    std::unique_lock lock(mtx);
+    std::string pending;
+
+    for (;;) {
+        flush_condition.wait_for(lock, std::chrono::milliseconds(CAPTURE_FLUSH_INTERVAL),
+            [this]() {
+                return terminated || buffer.size() >= CAPTURE_FLUSH_SIZE;
+            }
+        );
+
+        bool done = terminated;
+        pending.swap(buffer);
+        lock.unlock();
+        if (not pending.empty() && not writeAll(fd, pending))
+            active = false;
+        pending.clear();
+        lock.lock();
+
+        if (done)
+            return;
+    }
+}
+
+/*!
+ * \brief Чтение файла записи.
+ *
+ * Чтение останавливается на первой неполной записи.
+ *
+ * \param[in] path Путь к файлу.
+ * \param[out] frames Кадры в порядке записи.
+ * \return false, если файл не открывается или имеет другой формат.
+*/
+bool TrafficCapture::load(const std::string& path, std::vector<CapturedFrame>& frames) {
+    std::string data;
+    char chunk[65536];
+    ssize_t answ;
+
+    int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file == -1)
+        return false;
+    while ((answ = read(file, chunk, sizeof(chunk))) > 0)
+        data.append(chunk, static_cast<size_t>(answ));
+    ::close(file);
+
+    CaptureFileHeader header;
+    if (answ < 0 || data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION ||
+            header.record_header_size != sizeof(CaptureRecordHeader))
+        return false;
+
+    size_t offset = sizeof(header);
+    while (data.size() - offset >= sizeof(CaptureRecordHeader)) {
+        CaptureRecordHeader record;
+        memcpy(&record, data.data() + offset, sizeof(record));
+        offset += sizeof(record);
+        if (record.size > data.size() - offset)
+            break;
+        const uint8_t* begin = reinterpret_cast<const uint8_t*>(data.data() + offset);
+        frames.push_back({ record.timestamp_ns, record.connection,
+                           DataBuffer(begin, begin + record.size) });
+        offset += record.size;
+    }
+    return true;
+}
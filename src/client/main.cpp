@@ -2,11 +2,17 @@
  * \brief Тест клиента.
 */
 #include <ledctrl/client.h>
+#include "logger.h"
 
 #include <iostream>
+#include <fstream>
+#include <string>
 #include <thread>
 #include <chrono>
 #include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 static const std::string LOCALHOST_IP =
     "127.0.0.1";
@@ -14,19 +20,102 @@ static const std::string LOCALHOST_IP =
 using namespace mega_camera;
 
 
-void run_client(LedClient& client) {
+/*!
+ * \brief Передача файла потоком фрагментов.
+ *
+ * Без подтверждения держится не больше окна, объявленного сервером в ответе на
+ * stream-open.
+*/
+static bool stream_file(LedClient& client, const std::string& path) {
+    static const size_t CHUNK_SIZE = 32768;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    std::deque<std::string> replies;
+    std::mutex reply_mutex;
+    std::condition_variable reply_condition;
+
+    if (not file)
+        return false;
+    uint64_t size = static_cast<uint64_t>(file.tellg());
+    file.seekg(0);
+
+    client.setHandler(
+        [&](DataBuffer data) {
+            std::lock_guard lock(reply_mutex);
+            replies.emplace_back(data.begin(), data.end());
+            reply_condition.notify_one();
+        }
+    );
+    auto next_reply = [&]() {
+        std::unique_lock lock(reply_mutex);
+        if (not reply_condition.wait_for(lock, std::chrono::seconds(5),
+                                         [&replies]() { return not replies.empty(); }))
+            return std::string();
+        std::string reply = replies.front();
+        replies.pop_front();
+        return reply;
+    };
+
+    unsigned long id = 0;
+    unsigned long long window = 0;
+    client.sendData("stream-open " + std::to_string(size) + "\n");
+    if (std::sscanf(next_reply().c_str(), "OK %lu %llu", &id, &window) != 2)
+        return false;
+
+    std::string prefix = "stream-data " + std::to_string(id) + " ";
+    std::deque<size_t> inflight;
+    size_t inflight_bytes = 0;
+    std::string reply;
+    std::string chunk(CHUNK_SIZE, '\0');
+
+    for (uint64_t sent = 0; sent < size || not inflight.empty();) {
+        if (sent < size && inflight_bytes + prefix.size() + CHUNK_SIZE <= window) {
+            file.read(&chunk[0], static_cast<std::streamsize>(CHUNK_SIZE));
+            size_t count = static_cast<size_t>(file.gcount());
+            if (count == 0 || not client.sendData(prefix + chunk.substr(0, count)))
+                return false;
+            sent += count;
+            inflight.push_back(prefix.size() + count);
+            inflight_bytes += prefix.size() + count;
+            continue;
+        }
+        // Каждый ответ подтверждает один фрагмент и освобождает его место в окне
+        reply = next_reply();
+        if (reply.compare(0, 3, "OK ") != 0)
+            return false;
+        inflight_bytes -= inflight.front();
+        inflight.pop_front();
+    }
+
+    logInfo("Streamed", reply, { { "bytes", static_cast<int64_t>(size) } });
+    return true;
+}
+
+void run_client(LedClient& client, const std::string& unix_path,
+                bool shared_memory, const std::string& stream_path) {
     using namespace std::chrono_literals;
 
-    if (client.connectTo(LOCALHOST_IP,
-                         8014) != SocketStatus::connected) {
-        std::cerr << "Client isn't connected\n";
+    SocketStatus status = unix_path.empty()
+                          ? client.connectTo(LOCALHOST_IP, 8014)
+                          : client.connectUnix(unix_path, shared_memory);
+    if (status != SocketStatus::connected) {
+        logError("Client isn't connected");
         std::exit(EXIT_FAILURE);
     }
 
-    std::clog << "Client connected\n";
+    logInfo("Client connected");
+    if (not stream_path.empty()) {
+        bool streamed = stream_file(client, stream_path);
+        client.disconnect();
+        if (not streamed) {
+            logError("Stream failed");
+            std::exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
     client.setHandler(
         [&client](DataBuffer data) {
-            std::clog << "Recived " << data.size() << " bytes" << std::endl;
+            logInfo("Received", {}, { { "bytes", static_cast<int64_t>(data.size()) } });
         }
     );
     client.sendData("set-led-state off\n");
@@ -40,8 +129,31 @@ void run_client(LedClient& client) {
     client.disconnect();
 }
 
-int main(int, char**) {
+int main(int argc, char** argv) {
+    std::string unix_path;
+    std::string stream_path;
+    bool shared_memory = false;
+    int opt;
+
+    // -x путь к unix сокету сервера, -m через разделяемую память, -f передать файл
+    while ((opt = getopt(argc, argv, "x:mf:")) != -1) {
+        switch (opt) {
+        case 'x':
+            unix_path = optarg;
+            break;
+        case 'm':
+            shared_memory = true;
+            break;
+        case 'f':
+            stream_path = optarg;
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-x unix_socket [-m]] [-f file]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
     LedClient client;
-    run_client(client);
+    run_client(client, unix_path, shared_memory, stream_path);
     return EXIT_SUCCESS;
 }
@@ -2,10 +2,13 @@
  * \brief Реализация клиента.
 */
 #include <ledctrl/client.h>
+#include "shm_channel.h"
+#include "fd_passing.h"
+#include "logger.h"
 
 #include <stdio.h>
+#include <sys/uio.h>
 #include <cstring>
-#include <iostream>
 
 using namespace mega_camera;
 
@@ -21,7 +24,7 @@ void LedClient::handle_recv_thread() {
             }
         }
     } catch (std::exception& except) {
-        std::cerr << except.what() << std::endl;
+        logError("Receive failed", except.what());
     }
 }
 
@@ -48,6 +51,45 @@ SocketStatus LedClient::connectTo(const std::string &host, const uint16_t port)
     return _status = SocketStatus::connected;
 }
 
+/*!
+ * Соединение с сервером на том же узле через unix сокет.
+ *
+ * С shared_memory после подключения запрашивается канал в разделяемой памяти, и
+ * дальше сообщения идут через него. Сокет остается управляющим.
+ *
+ * \param[in] path Путь к unix сокету сервера.
+ * \param[in] shared_memory Использовать разделяемую память.
+ * \return Состояние сокета.
+*/
+SocketStatus LedClient::connectUnix(const std::string& path, bool shared_memory) noexcept {
+    sockaddr_un unix_address;
+
+    if (not makeUnixAddress(path, unix_address))
+        return _status = SocketStatus::err_socket_connect;
+    if ((_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return _status = SocketStatus::err_socket_init;
+
+    if (connect(_socket, reinterpret_cast<sockaddr *>(&unix_address),
+                sizeof(unix_address)) != 0) {
+        close(_socket);
+        return _status = SocketStatus::err_socket_connect;
+    }
+    _status = SocketStatus::connected;
+
+    if (not shared_memory)
+        return _status;
+
+    DataBuffer reply(1);
+    std::vector<int> fds;
+    if (not sendData(SHM_ATTACH_REQUEST) || recvFds(_socket, reply, fds) <= 0 ||
+            fds.size() != 3 ||
+            not (shm = ShmChannel::attach(fds[0], fds[1], fds[2], false))) {
+        close(_socket);
+        return _status = SocketStatus::err_socket_connect;
+    }
+    return _status;
+}
+
 /*!
  * \brief Отключение от сервера.
  *
@@ -57,8 +99,8 @@ SocketStatus LedClient::connectTo(const std::string &host, const uint16_t port)
  * \return Состояние сокета.
 */
 SocketStatus LedClient::disconnect() {
-    if (_status == SocketStatus::disconnected ||
-            _status == SocketStatus::err_socket_connect)
+    // Сервер мог закрыть соединение сам: поток приема все равно присоединяется
+    if (_socket == -1 || _status == SocketStatus::err_socket_connect)
         return _status;
 
     try {
@@ -66,15 +108,66 @@ SocketStatus LedClient::disconnect() {
         shutdown(_socket, SD_BOTH);
         if (recv_thread.joinable()) recv_thread.join();
         close(_socket);
+        _socket = -1;
+        shm.reset();
     } catch (std::exception& except) {
-        std::cerr << except.what() << std::endl;
+        logError("Disconnect failed", except.what());
     }
     return static_cast<SocketStatus>(_status);
 }
 
+/*!
+ * \brief Отправка буферов целиком одним sendmsg, с дозаписью при частичной отправке.
+*/
+static bool sendAll(Socket sock, iovec* vectors, size_t count) {
+    while (count) {
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = vectors;
+        message.msg_iovlen = count;
+
+        ssize_t answ = sendmsg(sock, &message, MSG_NOSIGNAL);
+        if (answ < 0 && errno == EINTR)
+            continue;
+        if (answ <= 0)
+            return false;
+
+        size_t sent = static_cast<size_t>(answ);
+        while (count && sent >= vectors->iov_len) {
+            sent -= vectors->iov_len;
+            ++vectors;
+            --count;
+        }
+        if (count) {
+            vectors->iov_base = static_cast<uint8_t*>(vectors->iov_base) + sent;
+            vectors->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+/*!
+ * \brief Пропуск данных кадра, который не будет обработан.
+*/
+static bool skipData(Socket sock, size_t size) {
+    uint8_t scratch[4096];
+    while (size) {
+        ssize_t answ = recv(sock, scratch, std::min(size, sizeof(scratch)), 0);
+        if (answ < 0 && errno == EINTR)
+            continue;
+        if (answ <= 0)
+            return false;
+        size -= static_cast<size_t>(answ);
+    }
+    return true;
+}
+
 /*!
  * \brief Прием данных.
  *
+ * Кадр больше MAX_MESSAGE_SIZE вычитывается и отбрасывается, чтобы не нарушить
+ * разбор следующих кадров.
+ *
  * \return buffer, .size() == 0 иначе.
 */
 DataBuffer LedClientBase::loadData() {
@@ -82,8 +175,16 @@ DataBuffer LedClientBase::loadData() {
     uint32_t size;
     int err;
 
+    if (shm) {
+        bool closed;
+        buffer = shm->receive(_socket, closed);
+        if (closed)
+            _status = SocketStatus::disconnected;
+        return buffer;
+    }
+
     //! Blocking mode.
-    int answ = recv(_socket, &size, sizeof(size), 0);
+    ssize_t answ = recv(_socket, &size, sizeof(size), MSG_WAITALL);
 
     if (answ == 0) {
         _status = SocketStatus::disconnected;
@@ -111,11 +212,18 @@ DataBuffer LedClientBase::loadData() {
         }
     }
 
-    if (size > MAX_MESSAGE_SIZE)
+    if (size > MAX_MESSAGE_SIZE) {
+        if (not skipData(_socket, size))
+            _status = SocketStatus::err_socket_read;
         return DataBuffer();
+    }
 
     buffer.resize(size);
-    answ = recv(_socket, buffer.data(), buffer.size(), 0);
+    answ = recv(_socket, buffer.data(), buffer.size(), MSG_WAITALL);
+    if (answ == 0 && size) {
+        _status = SocketStatus::disconnected;
+        return DataBuffer();
+    }
 
     return answ > 0 ? buffer : DataBuffer();
 }
@@ -126,21 +234,57 @@ DataBuffer LedClientBase::loadData() {
  * \param[in] str Данные для отправки.
 */
 bool LedClientBase::sendData(const std::string str) const noexcept {
-    const char *buffer = str.data();
-    uint32_t size = str.length();
-    char send_buffer[MAX_MESSAGE_SIZE];
+    uint32_t size = static_cast<uint32_t>(str.length());
 
-    if (size > MAX_MESSAGE_SIZE - sizeof(uint32_t) ||
+    if (str.length() > MAX_MESSAGE_SIZE ||
             _status != mega_camera::SocketStatus::connected)
         return false;
 
-    memcpy(send_buffer + sizeof(uint32_t), buffer, size);
-    memcpy(send_buffer, &size, sizeof(uint32_t));
+    if (shm)
+        return shm->send(str.data(), size);
 
-    if (send(_socket, send_buffer, size + sizeof(uint32_t), MSG_NOSIGNAL) < 0)
+    // Длина и данные уходят одним вызовом без копирования в промежуточный буфер
+    iovec vectors[2] = {
+        { &size, sizeof(size) },
+        { const_cast<char*>(str.data()), str.length() }
+    };
+    return sendAll(_socket, vectors, 2);
+}
+
+/*!
+ * \brief Отправка готового кадра.
+ *
+ * Кадр уже содержит длину, поэтому отправляется без копирования и форматирования.
+ *
+ * \param[in] frame Кадр из encodeFrame().
+ * \return Статус операции.
+*/
+bool LedClientBase::sendFrame(const DataBuffer& frame) const noexcept {
+    if (frame.size() < sizeof(uint32_t) ||
+            _status != mega_camera::SocketStatus::connected)
         return false;
 
-    return true;
+    if (shm)
+        return shm->send(frame.data() + sizeof(uint32_t),
+                         static_cast<uint32_t>(frame.size() - sizeof(uint32_t)));
+
+    iovec vector = { const_cast<uint8_t*>(frame.data()), frame.size() };
+    return sendAll(_socket, &vector, 1);
+}
+
+/*!
+ * \brief Кодирование сообщения в кадр.
+ *
+ * \param[in] str Сообщение.
+ * \return Кадр: длина (uint32_t) и данные.
+*/
+SharedFrame LedClientBase::encodeFrame(const std::string& str) {
+    uint32_t size = static_cast<uint32_t>(str.size());
+    auto frame = std::make_shared<DataBuffer>(sizeof(size) + str.size());
+
+    memcpy(frame->data(), &size, sizeof(size));
+    memcpy(frame->data() + sizeof(size), str.data(), str.size());
+    return frame;
 }
 
 /*!
@@ -0,0 +1,161 @@
+/*!
+ * \brief Реализация движка световых эффектов.
+*/
+#include "effects.h"
+
+#include <cmath>
+
+using namespace mega_camera;
+
+//! Доля периода, в которую горит устройство в группе "бегущего огня".
+static const float CHASE_DUTY = 1.0f / EFFECTS_CHASE_LENGTH;
+
+/*!
+ * \brief Вычисление уровней за один проход.
+ *
+ * Ветвления заменены выбором и взвешенной суммой, поэтому цикл векторизуется.
+*/
+static void effectsKernel(size_t count, float clock,
+                          const float* __restrict frequency,
+                          const float* __restrict offset,
+                          const float* __restrict steady,
+                          const float* __restrict blink,
+                          const float* __restrict fade,
+                          const float* __restrict chase,
+                          uint8_t* __restrict levels) {
+    for (size_t i = 0; i < count; ++i) {
+        float phase = clock * frequency[i] + offset[i];
+        phase -= static_cast<float>(static_cast<int>(phase));
+
+        float on = phase < 0.5f ? 1.0f : 0.0f;
+        float triangle = 1.0f - std::fabs(2.0f * phase - 1.0f);
+        float head = phase < CHASE_DUTY ? 1.0f : 0.0f;
+        float value = steady[i] + blink[i] * on + fade[i] * triangle + chase[i] * head;
+
+        levels[i] = static_cast<uint8_t>(value * 255.0f);
+    }
+}
+
+EffectsEngine::EffectsEngine(size_t count)
+    : frequency(count, 0.0f)
+    , offset(count, 0.0f)
+    , steady(count, 0.0f)
+    , blink(count, 0.0f)
+    , fade(count, 0.0f)
+    , chase(count, 0.0f)
+    , levels(count, 0)
+    , published(count, 0)
+    , clock(0.0f)
+    , timer()
+    , mtx()
+    , publish_mtx()
+    , timer_condition()
+    , terminated(false)
+    , tick_count(0)
+{}
+
+EffectsEngine::~EffectsEngine() {
+    stop();
+}
+
+/*!
+ * \brief Настройка устройства по его состоянию.
+ *
+ * \param[in] index Номер устройства.
+ * \param[in] led Состояние устройства.
+*/
+void EffectsEngine::configure(size_t index, const Led& led) {
+    if (index >= levels.size())
+        return;
+
+    float enabled = led.state == ON ? 1.0f : 0.0f;
+    std::lock_guard lock(mtx);
+    frequency[index] = static_cast<float>(led.rate);
+    // Устройства группы сдвинуты так, что огонь идет по возрастанию номеров
+    offset[index] = led.effect == CHASE
+        ? 1.0f - static_cast<float>(index % EFFECTS_CHASE_LENGTH) * CHASE_DUTY : 0.0f;
+    steady[index] = led.effect == NONE ? enabled : 0.0f;
+    blink[index] = led.effect == BLINK ? enabled : 0.0f;
+    fade[index] = led.effect == FADE ? enabled : 0.0f;
+    chase[index] = led.effect == CHASE ? enabled : 0.0f;
+}
+
+/*!
+ * \brief Тик: продвижение часов и пересчет уровней всех устройств.
+ *
+ * \param[in] elapsed Время с прошлого тика, с.
+*/
+void EffectsEngine::tick(float elapsed) {
+    {
+        std::lock_guard lock(mtx);
+        clock += elapsed;
+        clock -= static_cast<float>(static_cast<int>(clock));
+        effectsKernel(levels.size(), clock, frequency.data(), offset.data(),
+                      steady.data(), blink.data(), fade.data(), chase.data(),
+                      levels.data());
+
+        std::lock_guard publish_lock(publish_mtx);
+        published = levels;
+    }
+    ++tick_count;
+}
+
+/*!
+ * \brief Запуск потока таймера.
+ *
+ * \param[in] tick_rate Частота тиков, Гц.
+ * \return Статус операции.
+*/
+bool EffectsEngine::start(uint tick_rate) {
+    if (tick_rate == 0 || timer.joinable())
+        return false;
+
+    terminated = false;
+    timer = std::thread(&EffectsEngine::timerLoop, this,
+                        std::chrono::microseconds(1000000 / tick_rate));
+    return true;
+}
+
+void EffectsEngine::stop() {
+    {
+        std::lock_guard lock(mtx);
+        terminated = true;
+    }
+    timer_condition.notify_all();
+    if (timer.joinable())
+        timer.join();
+}
+
+/*!
+ * \brief Текущий уровень устройства.
+*/
+uint8_t EffectsEngine::level(size_t index) {
+    std::lock_guard lock(publish_mtx);
+    return index < published.size() ? published[index] : 0;
+}
+
+/*!
+ * \brief Поток таймера.
+ *
+ * Тики идут по абсолютному расписанию, в тик передается фактически прошедшее время,
+ * поэтому задержка одного тика не сдвигает фазу эффектов.
+*/
+void EffectsEngine::timerLoop(std::chrono::microseconds period) {
+    auto previous = std::chrono::steady_clock::now();
+    auto next = previous + period;
+
+    for (;;) {
+        {
+            std::unique_lock lock(mtx);
+            if (timer_condition.wait_until(lock, next, [this]() { return terminated; }))
+                return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        tick(std::chrono::duration<float>(now - previous).count());
+        previous = now;
+        next += period;
+        if (next < now)
+            next = now + period;
+    }
+}
@@ -0,0 +1,101 @@
+/*!
+ * \brief Запись трафика сервера.
+*/
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <ledctrl/general.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mega_camera {
+
+//! Сигнатура файла записи ("LCAP").
+static const uint32_t CAPTURE_MAGIC = 0x5041434c;
+//! Версия формата файла записи.
+static const uint16_t CAPTURE_VERSION = 1;
+//! Объем накопленных записей, после которого поток записи будится сразу.
+static const size_t CAPTURE_FLUSH_SIZE = 1 << 16;
+//! Предел буфера в памяти, сверх него кадры отбрасываются.
+static const size_t CAPTURE_MAX_BUFFER = 1 << 24;
+//! Период сброса буфера при слабом трафике, мс.
+static const int CAPTURE_FLUSH_INTERVAL = 100;
+
+//! Заголовок файла записи.
+struct CaptureFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_header_size;
+};
+
+/*!
+ * \brief Заголовок записи кадра.
+ *
+ * За заголовком следуют size байтов кадра. Время отсчитывается от начала записи.
+*/
+struct CaptureRecordHeader {
+    uint64_t timestamp_ns;
+    uint32_t connection;
+    uint32_t size;
+};
+
+//! Прочитанный кадр.
+struct CapturedFrame {
+    uint64_t timestamp_ns;
+    uint32_t connection;
+    DataBuffer data;
+};
+
+/*!
+ * \brief Запись входящих кадров в файл.
+ *
+ * record() только дописывает кадр в буфер в памяти под коротким мьютексом, файл
+ * пишет отдельный поток. Выключенная запись стоит одной атомарной проверки. Если
+ * диск не успевает и буфер превышает CAPTURE_MAX_BUFFER, кадры отбрасываются и
+ * учитываются в dropped().
+*/
+class TrafficCapture {
+    int fd;
+    std::chrono::steady_clock::time_point origin;
+    std::string buffer;
+
+    std::thread writer;
+    std::mutex mtx;
+    std::condition_variable flush_condition;
+    std::atomic<bool> active;
+    bool terminated;
+    std::atomic<uint64_t> dropped_count;
+
+    void append(uint32_t connection, const DataBuffer& data);
+    void writerLoop();
+
+  public:
+    TrafficCapture();
+    ~TrafficCapture();
+
+    TrafficCapture(const TrafficCapture&) = delete;
+    TrafficCapture& operator=(const TrafficCapture&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    void record(uint32_t connection, const DataBuffer& data) {
+        if (active.load(std::memory_order_relaxed))
+            append(connection, data);
+    }
+
+    uint64_t dropped() const {
+        return dropped_count;
+    }
+
+    static bool load(const std::string& path, std::vector<CapturedFrame>& frames);
+};
+
+}
+
+#endif // __CAPTURE_H__
@@ -0,0 +1,83 @@
+/*!
+ * \brief Движок световых эффектов.
+*/
+#ifndef __EFFECTS_H__
+#define __EFFECTS_H__
+
+#include "led_state.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mega_camera {
+
+//! Частота тиков движка эффектов по умолчанию, Гц.
+static const uint EFFECTS_TICK_RATE = 100;
+//! Длина группы эффекта "бегущий огонь": горит одно устройство из стольких подряд.
+static const uint EFFECTS_CHASE_LENGTH = 8;
+
+/*!
+ * \brief Движок эффектов.
+ *
+ * Клиент задает эффект устройства один раз, яркость (0-255) всех устройств считает
+ * сервер на каждом тике. Частота эффекта - LedRate в Гц, 0 останавливает эффект.
+ *
+ * Параметры хранятся в непрерывных массивах по одному на поле (SoA), эффект задан
+ * весами steady/blink/fade/chase, из которых ровно один равен 1 для включенного
+ * устройства. Так тик - один проход без ветвлений по массивам float, который
+ * компилятор векторизует. Фаза считается от общих часов, поэтому эффекты устройств с
+ * одной частотой синхронны и не требуют состояния между тиками.
+ *
+ * Тики выполняет один поток таймера для всех устройств. Готовые уровни публикуются
+ * копией под мьютексом, чтение не ждет вычисления тика.
+*/
+class EffectsEngine {
+    std::vector<float> frequency;
+    std::vector<float> offset;
+    std::vector<float> steady;
+    std::vector<float> blink;
+    std::vector<float> fade;
+    std::vector<float> chase;
+    std::vector<uint8_t> levels;
+    std::vector<uint8_t> published;
+    //! Время в пределах секунды: целые частоты периодичны с периодом 1 с.
+    float clock;
+
+    std::thread timer;
+    std::mutex mtx;
+    std::mutex publish_mtx;
+    std::condition_variable timer_condition;
+    bool terminated;
+    std::atomic<uint64_t> tick_count;
+
+    void timerLoop(std::chrono::microseconds period);
+
+  public:
+    explicit EffectsEngine(size_t count = LED_MAX_DEVICES);
+    ~EffectsEngine();
+
+    EffectsEngine(const EffectsEngine&) = delete;
+    EffectsEngine& operator=(const EffectsEngine&) = delete;
+
+    void configure(size_t index, const Led& led);
+    void tick(float elapsed);
+    bool start(uint tick_rate);
+    void stop();
+    uint8_t level(size_t index);
+
+    size_t size() const {
+        return levels.size();
+    }
+
+    uint64_t ticks() const {
+        return tick_count;
+    }
+};
+
+}
+
+#endif // __EFFECTS_H__
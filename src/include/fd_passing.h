@@ -0,0 +1,113 @@
+/*!
+ * \brief Передача файловых дескрипторов через unix сокет (SCM_RIGHTS).
+*/
+#ifndef __FD_PASSING_H__
+#define __FD_PASSING_H__
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace mega_camera {
+
+//! Максимальное число дескрипторов в одном сообщении.
+static const size_t MAX_PASSED_FDS = 64;
+
+/*!
+ * \brief Заполнение адреса unix сокета.
+ *
+ * \param[in] path Путь к сокету.
+ * \param[out] address Адрес.
+ * \return false, если путь не помещается в sun_path.
+*/
+inline bool makeUnixAddress(const std::string& path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        return false;
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+/*!
+ * \brief Отправка сообщения с дескрипторами.
+ *
+ * \param[in] sock Unix сокет.
+ * \param[in] data Данные сообщения.
+ * \param[in] size Размер данных.
+ * \param[in] fds Дескрипторы, не более MAX_PASSED_FDS.
+ * \return Статус операции.
+*/
+inline bool sendFds(int sock, const void* data, size_t size,
+                    const std::vector<int>& fds) {
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    iovec iov = { const_cast<void*>(data), size };
+    msghdr msg;
+
+    if (fds.size() > MAX_PASSED_FDS)
+        return false;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (not fds.empty()) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(size);
+}
+
+/*!
+ * \brief Прием сообщения с дескрипторами.
+ *
+ * \param[in] sock Unix сокет.
+ * \param[out] data Буфер данных, размер уменьшается до принятого.
+ * \param[out] fds Принятые дескрипторы.
+ * \return Размер сообщения, 0 при закрытии, -1 при ошибке.
+*/
+inline ssize_t recvFds(int sock, std::vector<uint8_t>& data,
+                       std::vector<int>& fds) {
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    iovec iov = { data.data(), data.size() };
+    msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    fds.clear();
+    ssize_t answ = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (answ < 0)
+        return answ;
+
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        fds.resize(count);
+        memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+    }
+
+    data.resize(static_cast<size_t>(answ));
+    return answ;
+}
+
+}
+
+#endif // __FD_PASSING_H__
@@ -0,0 +1,89 @@
+/*!
+ * \brief Журнал изменяющих команд.
+*/
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace mega_camera {
+
+//! Порог размера журнала для автоматического сжатия.
+static const size_t JOURNAL_COMPACT_THRESHOLD = 1 << 20;
+
+/*!
+ * \brief Журнал с групповой фиксацией.
+ *
+ * Записи ставятся в очередь вызовом append(), единственный поток записи собирает все
+ * накопившиеся записи в одну запись в файл и один fdatasync, после чего разом
+ * освобождает всех ожидающих в waitDurable(). Формат записи: длина (uint32_t),
+ * контрольная сумма FNV-1a (uint32_t), данные.
+ *
+ * Сжатие заменяет журнал снимком: набором записей, воспроизводящих текущее состояние.
+ * Записи должны быть идемпотентными, тогда повтор журнала поверх более нового
+ * состояния безопасен.
+ *
+ * Ошибка записи отменяет только записи своей группы, их ожидающие получают false.
+ * Следующее сжатие восстанавливает журнал, ошибка и восстановление пишутся в лог.
+*/
+class Journal {
+  public:
+    typedef std::function<void(const std::string&)> replay_function_t;
+    typedef std::function<std::vector<std::string>()> snapshot_function_t;
+
+    Journal();
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    bool open(const std::string& path, replay_function_t replay,
+              snapshot_function_t snapshot,
+              size_t compact_threshold = JOURNAL_COMPACT_THRESHOLD);
+    void close();
+
+    uint64_t append(std::string record);
+    uint64_t lastTicket();
+    bool waitDurable(uint64_t ticket);
+    bool compact();
+    std::string openedPath();
+
+  private:
+    int fd;
+    std::string path;
+    size_t file_size;
+    size_t compact_threshold;
+    snapshot_function_t snapshot;
+
+    std::thread writer;
+    std::mutex mtx;
+    std::condition_variable pending_condition;
+    std::condition_variable durable_condition;
+    std::vector<std::string> pending;
+    uint64_t appended_seq;
+    uint64_t durable_seq;
+    //! Последняя запись, не попавшая на диск из-за ошибки.
+    uint64_t failed_seq;
+    uint64_t compact_requested;
+    uint64_t compact_done;
+    bool opened;
+    //! Файл может быть испорчен ошибкой записи, нужно сжатие.
+    bool failed;
+    bool terminated;
+
+    static void encode(const std::string& record, std::string& out);
+    bool replay(replay_function_t replay_fn);
+    bool rewrite(const std::vector<std::string>& records);
+    void writerLoop();
+};
+
+}
+
+#endif // __JOURNAL_H__
@@ -0,0 +1,123 @@
+/*!
+ * \brief Состояние светодиодов в отображаемой памяти.
+*/
+#ifndef __LED_STATE_H__
+#define __LED_STATE_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+namespace mega_camera {
+
+//! Состояние светодиода
+typedef enum LedState : uint8_t {
+    ON = 0
+  , OFF = 1
+} LedState;
+
+//! Цвет светодиода
+typedef enum LedColor : uint8_t {
+    RED = 0
+  , GREEN = 1
+  , BLUE = 2
+} LedColor;
+
+typedef uint8_t LedRate;
+
+//! Эффект, вычисляемый сервером
+typedef enum LedEffect : uint8_t {
+    NONE = 0
+  , BLINK = 1
+  , FADE = 2
+  , CHASE = 3
+} LedEffect;
+
+typedef struct Led {
+    enum LedState state;
+    enum LedColor color;
+    LedRate rate;
+    enum LedEffect effect;
+} Led;
+
+//! Сигнатура файла состояния ("LEDS").
+static const uint32_t LED_STATE_MAGIC = 0x5344454c;
+//! Версия формата файла состояния.
+static const uint16_t LED_STATE_VERSION = 2;
+//! Число записей в таблице устройств.
+static const uint32_t LED_MAX_DEVICES = 256;
+//! Состояние устройства по умолчанию.
+static const Led LED_DEFAULT = { ON, RED, 4, NONE };
+
+/*!
+ * \brief Заголовок файла состояния.
+ *
+ * За заголовком следует таблица из capacity записей Led.
+*/
+struct LedStateHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t generation;
+};
+
+/*!
+ * \brief Хранилище состояния светодиодов.
+ *
+ * Таблица устройств лежит в отображаемой памяти. Без файла используется анонимное
+ * отображение, с файлом - разделяемое, и восстановление при запуске сводится к mmap и
+ * проверке заголовка. Запись состояния не требует системных вызовов, долговечность
+ * обеспечивается msync: явным вызовом sync() или периодически из фонового потока.
+ * Синхронизация доступа к таблице - забота вызывающего.
+*/
+class LedStateStore {
+    LedStateHeader* header;
+    Led* table;
+    size_t mapped_size;
+    int fd;
+
+    std::thread sync_thread;
+    std::mutex sync_mtx;
+    std::condition_variable sync_condition;
+    bool sync_terminated;
+
+    static size_t mappingSize();
+    void initialize(const LedStateHeader* from);
+    void migrateV1();
+    void unmap();
+    void syncLoop(std::chrono::milliseconds interval);
+
+  public:
+    LedStateStore();
+    ~LedStateStore();
+
+    LedStateStore(const LedStateStore&) = delete;
+    LedStateStore& operator=(const LedStateStore&) = delete;
+
+    bool open(const std::string& path, bool& restored);
+    bool sync();
+    void startPeriodicSync(std::chrono::milliseconds interval);
+    void stopPeriodicSync();
+
+    Led& device(size_t index) {
+        return table[index];
+    }
+
+    LedStateHeader& state() {
+        return *header;
+    }
+
+    bool persistent() const {
+        return fd != -1;
+    }
+};
+
+}
+
+#endif // __LED_STATE_H__
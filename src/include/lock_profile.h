@@ -0,0 +1,118 @@
+/*!
+ * \brief Профилирование блокировок.
+ *
+ * ProfiledMutex считает захваты именованной блокировки, захваты с ожиданием и строит
+ * гистограммы времени ожидания и удержания. Блокировки с одним именем (например,
+ * access_mtx всех клиентов) учитываются вместе. Отчет возвращает lockProfileReport().
+ *
+ * Профилирование собирается при определенном LEDCTRL_LOCK_PROFILING (опция CMake).
+ * Без него ProfiledMutex - это std::mutex, а ProfiledCondition - std::condition_variable,
+ * имя блокировки не хранится.
+*/
+#ifndef __LOCK_PROFILE_H__
+#define __LOCK_PROFILE_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace mega_camera {
+
+#ifdef LEDCTRL_LOCK_PROFILING
+
+//! Число интервалов гистограммы. Интервал i - от 2^(i-1) до 2^i нс, последний - больше.
+static const size_t LOCK_HISTOGRAM_SIZE = 32;
+//! Число частей счетчиков блокировки. Поток пишет в часть своего номера по модулю.
+static const size_t LOCK_STATS_SHARDS = 16;
+
+struct LockStats;
+
+/*!
+ * \brief Блокировка со счетчиками захватов.
+ *
+ * Захват без ожидания стоит одной попытки try_lock и чтения часов.
+*/
+class ProfiledMutex {
+    std::mutex mtx;
+    LockStats& stats;
+    //! Время захвата, пишет только владелец.
+    uint64_t acquired;
+
+  public:
+    explicit ProfiledMutex(const char* name);
+
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+};
+
+//! std::condition_variable ждет только std::unique_lock<std::mutex>.
+typedef std::condition_variable_any ProfiledCondition;
+
+std::string lockProfileReport();
+void lockProfileReset();
+
+#else
+
+class ProfiledMutex : public std::mutex {
+  public:
+    explicit ProfiledMutex(const char*) {}
+};
+
+/*!
+ * \brief std::condition_variable для std::unique_lock<ProfiledMutex>.
+ *
+ * Ожидание выполняется на той же std::mutex, без дополнительной блокировки.
+*/
+class ProfiledCondition {
+    std::condition_variable condition;
+
+  public:
+    ProfiledCondition() : condition() {}
+
+    void notify_one() noexcept {
+        condition.notify_one();
+    }
+
+    void notify_all() noexcept {
+        condition.notify_all();
+    }
+
+    void wait(std::unique_lock<ProfiledMutex>& lock) {
+        std::unique_lock<std::mutex> native(*lock.mutex(), std::adopt_lock);
+        condition.wait(native);
+        native.release();
+    }
+
+    template<class Predicate>
+    void wait(std::unique_lock<ProfiledMutex>& lock, Predicate predicate) {
+        while (not predicate())
+            wait(lock);
+    }
+
+    template<class Rep, class Period>
+    std::cv_status wait_for(std::unique_lock<ProfiledMutex>& lock,
+                            const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock<std::mutex> native(*lock.mutex(), std::adopt_lock);
+        std::cv_status status = condition.wait_for(native, timeout);
+        native.release();
+        return status;
+    }
+};
+
+inline std::string lockProfileReport() {
+    return "";
+}
+
+inline void lockProfileReset() {}
+
+#endif // LEDCTRL_LOCK_PROFILING
+
+}
+
+#endif // __LOCK_PROFILE_H__
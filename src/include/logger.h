@@ -0,0 +1,108 @@
+/*!
+ * \brief Асинхронный журнал сообщений.
+ *
+ * Сообщение записывается в кольцо текущего потока записью фиксированного размера без
+ * блокировок и форматирования. Фоновый поток раз в LOG_FLUSH_PERIOD забирает записи
+ * всех колец, форматирует их в строки и пишет в файл (по умолчанию stderr). Если
+ * кольцо заполнено, запись отбрасывается и учитывается в счетчике, фоновый поток
+ * сообщает о потерях отдельной строкой.
+ *
+ * Сообщения ниже уровня setLogLevel() стоят одной атомарной проверки.
+*/
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+
+namespace mega_camera {
+
+//! Число записей в кольце одного потока, степень двойки.
+static const size_t LOG_RING_SIZE = 1024;
+//! Наибольшая длина текста записи, более длинный текст обрезается.
+static const size_t LOG_TEXT_SIZE = 64;
+//! Наибольшее число полей записи.
+static const size_t LOG_FIELDS = 4;
+//! Период вывода записей фоновым потоком.
+static const std::chrono::milliseconds LOG_FLUSH_PERIOD(20);
+
+//! Уровни сообщений.
+enum class LogLevel : uint8_t {
+    debug = 0,
+    info,
+    warning,
+    error
+};
+
+/*!
+ * \brief Поле записи: имя=число или имя=строка.
+ *
+ * Имя и строка не копируются и должны жить до конца процесса (литералы, таблицы имен).
+*/
+struct LogField {
+    const char* name;
+    int64_t value;
+    const char* text;
+
+    LogField(const char* _name, int64_t _value) : name(_name), value(_value), text(nullptr) {}
+    LogField(const char* _name, const char* _text) : name(_name), value(0), text(_text) {}
+};
+
+//! Счетчики журнала.
+struct LogStats {
+    uint64_t written;   //!< Выведено записей
+    uint64_t dropped;   //!< Отброшено из-за заполненных колец
+};
+
+//! Наименьший выводимый уровень.
+extern std::atomic<LogLevel> log_level;
+
+inline bool logEnabled(LogLevel level) {
+    return level >= log_level.load(std::memory_order_relaxed);
+}
+
+void setLogLevel(LogLevel level);
+bool setLogFile(const std::string& path);
+void logWrite(LogLevel level, const char* message, std::string_view text,
+              std::initializer_list<LogField> fields);
+void logFlush();
+LogStats getLogStats();
+
+/*!
+ * \brief Запись сообщения.
+ *
+ * \param[in] message Сообщение, литерал.
+ * \param[in] text Текст, копируется в запись.
+ * \param[in] fields Поля.
+*/
+inline void logDebug(const char* message, std::string_view text = {},
+                     std::initializer_list<LogField> fields = {}) {
+    if (logEnabled(LogLevel::debug))
+        logWrite(LogLevel::debug, message, text, fields);
+}
+
+inline void logInfo(const char* message, std::string_view text = {},
+                    std::initializer_list<LogField> fields = {}) {
+    if (logEnabled(LogLevel::info))
+        logWrite(LogLevel::info, message, text, fields);
+}
+
+inline void logWarning(const char* message, std::string_view text = {},
+                       std::initializer_list<LogField> fields = {}) {
+    if (logEnabled(LogLevel::warning))
+        logWrite(LogLevel::warning, message, text, fields);
+}
+
+inline void logError(const char* message, std::string_view text = {},
+                     std::initializer_list<LogField> fields = {}) {
+    if (logEnabled(LogLevel::error))
+        logWrite(LogLevel::error, message, text, fields);
+}
+
+}
+
+#endif // __LOGGER_H__
@@ -0,0 +1,82 @@
+/*!
+ * \brief Репликация состояния на ведомые серверы.
+*/
+#ifndef __REPLICATION_H__
+#define __REPLICATION_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mega_camera {
+
+//! Число последних изменений, которые ведущий хранит для отстающих ведомых.
+static const size_t REPLICATION_LOG_SIZE = 8192;
+//! Наибольшее число изменений в одном пакете.
+static const size_t REPLICATION_BATCH = 512;
+//! Период пустых пакетов, по которым ведомый видит, что догнал ведущего.
+static const std::chrono::milliseconds REPLICATION_HEARTBEAT(100);
+//! Молчание ведущего, после которого ведомый переподключается, и таймаут пересылки.
+static const std::chrono::milliseconds REPLICATION_TIMEOUT(1000);
+//! Период повторной отправки ведомому, который еще не принял предыдущий пакет.
+static const std::chrono::milliseconds REPLICATION_SEND_RETRY(5);
+//! Пауза перед повторным подключением ведомого.
+static const std::chrono::milliseconds REPLICATION_RETRY(500);
+
+//! Изменение в журнале репликации.
+struct ReplicationRecord {
+    uint64_t seq;
+    //! Время фиксации изменения ведущим, нс от эпохи (CLOCK_REALTIME).
+    uint64_t time_ns;
+    std::string command;
+};
+
+//! Состояние репликации.
+struct ReplicationStats {
+    uint32_t followers;     //!< Ведущий: подключенные ведомые
+    bool connected;         //!< Ведомый: поток изменений подключен
+    uint64_t applied;       //!< Номер последнего примененного изменения
+    uint64_t primary;       //!< Номер последнего изменения ведущего
+    uint64_t lag_us;        //!< Задержка последнего изменения от фиксации до применения
+    uint64_t batches;       //!< Принято пакетов
+    uint64_t snapshots;     //!< Принято снимков
+    uint64_t forwarded;     //!< Переслано команд set-* ведущему
+};
+
+/*!
+ * \brief Журнал изменений ведущего в памяти.
+ *
+ * Изменения получают сквозные номера в порядке фиксации. Хранятся последние
+ * REPLICATION_LOG_SIZE изменений: ведомый, отставший сильнее, получает снимок.
+ * Пока журнал не включен, append() ничего не делает.
+*/
+class ReplicationLog {
+  public:
+    ReplicationLog();
+
+    ReplicationLog(const ReplicationLog&) = delete;
+    ReplicationLog& operator=(const ReplicationLog&) = delete;
+
+    void enable();
+    void disable();
+    uint64_t append(const std::string& command);
+    uint64_t lastSeq();
+    bool read(uint64_t from, size_t max_count, std::vector<ReplicationRecord>& records);
+    void wait(uint64_t seq, std::chrono::milliseconds timeout);
+
+  private:
+    std::mutex mtx;
+    std::condition_variable append_condition;
+    std::deque<ReplicationRecord> records;
+    uint64_t last_seq;
+    bool enabled;
+};
+
+}
+
+#endif // __REPLICATION_H__
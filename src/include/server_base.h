@@ -5,10 +5,19 @@
 #define __LED_SERVER_H__
 
 #include <ledctrl/general.h>
+#include <ledctrl/client.h>
 #include "thread_pool.h"
+#include "capture.h"
+#include "replication.h"
+#include "lock_profile.h"
 
+#include <deque>
 #include <functional>
+#include <future>
 #include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
 #include <thread>
 #include <mutex>
 #include <shared_mutex>
@@ -17,10 +26,83 @@
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <chrono>
 
 
 namespace mega_camera {
 
+//! Таймаут poll в циклах приема, мс. Определяет время реакции на остановку и передачу.
+static const int LOOP_POLL_TIMEOUT = 100;
+
+//! Ожидание подтверждения другой стороны при горячем обновлении, мс.
+static const int UPGRADE_CONFIRM_TIMEOUT = 5000;
+
+//! Число потоков отдельного пула циклов приема.
+static const uint IO_THREAD_COUNT = 2;
+
+//! Число датаграмм, читаемых одним recvmmsg.
+static const uint UDP_BATCH = 64;
+
+//! Размер буфера одной датаграммы.
+static const size_t UDP_DATAGRAM_SIZE = 2048;
+
+//! Предел числа отслеживаемых отправителей UDP.
+static const size_t UDP_MAX_SENDERS = 4096;
+
+//! Окно потоковой передачи по умолчанию: байты без подтверждения на подключение.
+static const size_t STREAM_WINDOW = 1 << 18;
+
+//! Наибольший фрагмент потоковой передачи.
+static const size_t STREAM_CHUNK_SIZE = MAX_MESSAGE_SIZE / 2;
+
+//! Число одновременных передач одного клиента.
+static const size_t STREAM_MAX_PER_CLIENT = 4;
+
+//! Префикс кадра с фрагментом потоковой передачи.
+static const char STREAM_DATA_PREFIX[] = "stream-data ";
+
+/*!
+ * \brief Состояние одной потоковой передачи.
+ *
+ * Данные не накапливаются: каждый фрагмент передается обработчику и учитывается в
+ * контрольной сумме FNV-1a, после чего освобождается.
+*/
+struct StreamTransfer {
+    uint64_t size;
+    uint64_t received;
+    uint32_t checksum;
+};
+
+/*!
+ * \brief Счетчики быстрого пути UDP.
+*/
+struct UdpStats {
+    uint64_t received;
+    uint64_t applied;
+    //! Устаревшие и пришедшие не по порядку.
+    uint64_t stale;
+    //! Перекрытые более новым значением в той же пачке.
+    uint64_t coalesced;
+    //! Нераспознанные и не set-* команды.
+    uint64_t rejected;
+};
+
+/*!
+ * \brief Размещение потоков сервера.
+ *
+ * Обработчики закрепляются за worker_cpus (или за процессорами узла numa_node). Если
+ * задан io_cpus, циклы приема соединений и данных выполняются в отдельном пуле,
+ * закрепленном за этими процессорами, и не делят ядра с обработчиками.
+*/
+struct PlacementConfig {
+    std::vector<int> worker_cpus = {};
+    std::vector<int> io_cpus = {};
+    int numa_node = -1;
+    bool numa_local = false;
+};
+
 /*!
  * \brief Класс сервера
  *
@@ -34,6 +116,9 @@ struct LedServer {
     handler_function_t;
     typedef std::function<void(Client&)>
     con_handler_function_t;
+    //! Обработчик фрагмента: номер передачи, данные, последний фрагмент.
+    typedef std::function<bool(Client&, uint32_t, const uint8_t*, size_t, bool)>
+    stream_handler_function_t;
 
     LedServer(
         const uint16_t port,
@@ -44,7 +129,8 @@ struct LedServer {
         con_handler_function_t disconnect_hndl =
             default_connection_handler,
         uint thread_count =
-            std::thread::hardware_concurrency()
+            std::thread::hardware_concurrency(),
+        PlacementConfig placement = {}
     );
 
     ~LedServer();
@@ -54,13 +140,84 @@ struct LedServer {
     }
 
     SocketStatus start();
+    SocketStatus listenUnix(const std::string& path);
+    SocketStatus takeover(const std::string& upgrade_path,
+                          const std::string& journal_path = "");
+    SocketStatus enableUpgrade(const std::string& upgrade_path);
+    SocketStatus enableUdp(const uint16_t udp_port);
+    UdpStats getUdpStats() const;
+    SocketStatus enableReplication(const uint16_t replication_port);
+    SocketStatus followPrimary(const std::string& host, const uint16_t replication_port);
+    ReplicationStats getReplicationStats() const;
     void stop();
     void joinLoop();
+    void setQueueCapacity(JobPriority priority, size_t capacity);
+    LaneStats getQueueStats(JobPriority priority);
+    void setPoolBounds(uint min_threads, uint max_threads);
+    PoolStats getPoolStats();
+    bool openState(const std::string& path,
+                   std::chrono::milliseconds sync_interval);
+    bool syncState();
+    bool startEffects(uint tick_rate);
+    void stopEffects();
+    bool openJournal(const std::string& path, bool replay = true);
+    bool compactJournal();
+    bool reopenJournal();
+    bool startCapture(const std::string& path);
+    void stopCapture();
+    bool setTracing(const std::string& path, bool enabled);
+    void setStreamWindow(size_t window);
+    void setStreamHandler(stream_handler_function_t stream_hndl);
     static void print_screen(void);
 
   private:
     Socket serv_socket;
     ThreadPool thread_pool;
+    //! Пул циклов приема, если они вынесены на отдельные ядра.
+    std::unique_ptr<ThreadPool> io_pool;
+
+    //! Сокет для клиентов на том же узле.
+    Socket unix_socket = -1;
+    std::string unix_path;
+
+    //! Быстрый путь UDP: сокет и последние номера датаграмм отправителей.
+    Socket udp_socket = -1;
+    std::unordered_map<uint64_t, uint64_t> udp_sequence;
+    std::atomic<uint64_t> udp_received = 0;
+    std::atomic<uint64_t> udp_applied = 0;
+    std::atomic<uint64_t> udp_stale = 0;
+    std::atomic<uint64_t> udp_coalesced = 0;
+    std::atomic<uint64_t> udp_rejected = 0;
+
+    //! Репликация: ведущий раздает изменения ведомым, ведомый применяет их.
+    Socket replication_socket = -1;
+    std::thread replication_thread;
+    std::atomic<bool> replicating = false;
+    std::mutex replication_mtx;
+    std::condition_variable replication_condition;
+    std::atomic<uint32_t> replication_followers = 0;
+    //! Ведомый: адрес ведущего, его порт команд из снимка и пересылка set-*.
+    std::string primary_host;
+    uint16_t primary_port = 0;
+    std::atomic<uint16_t> primary_command_port = 0;
+    std::unique_ptr<LedClient> primary_client;
+    std::mutex forward_mtx;
+    std::deque<std::shared_ptr<std::promise<DataBuffer>>> forward_pending;
+    std::atomic<bool> replica_connected = false;
+    std::atomic<uint64_t> replica_applied = 0;
+    std::atomic<uint64_t> replica_primary = 0;
+    std::atomic<uint64_t> replica_lag_us = 0;
+    std::atomic<uint64_t> replica_batches = 0;
+    std::atomic<uint64_t> replica_snapshots = 0;
+    std::atomic<uint64_t> replica_forwarded = 0;
+
+    //! Горячее обновление: unix сокет для передачи сокетов преемнику.
+    std::string upgrade_path;
+    Socket upgrade_socket = -1;
+    std::thread upgrade_thread;
+    std::atomic<bool> handing_off = false;
+    std::atomic<bool> handed_over = false;
+    std::shared_mutex loop_mtx;
 
     uint16_t port;
     SocketStatus _status = SocketStatus::close;
@@ -76,14 +233,47 @@ struct LedServer {
 
     KeepAliveConfig ka_conf;
     std::list<std::unique_ptr<Client>> client_list;
-    std::mutex client_mutex;
+    ProfiledMutex client_mutex;
+    //! Номер последнего подключения, для записи трафика.
+    std::atomic<uint32_t> last_client_id = 0;
+    TrafficCapture capture;
+
+    //! Потоковая передача: окно на подключение и обработчик фрагментов.
+    std::atomic<size_t> stream_window = STREAM_WINDOW;
+    stream_handler_function_t stream_hndl;
 
     bool enableKeepAlive(Socket socket);
     void handlingAcceptLoop();
+    void acceptClient(Socket listener, bool unix_domain);
     void waitingDataLoop();
+    void postDisconnect(std::unique_ptr<Client>& client);
+    bool attachShm(Client& client);
+    void receiveDatagrams();
+    void startReplication(Socket sock);
+    void replicationLoop();
+    void followLoop();
+    bool applyReplicationFrame(const DataBuffer& frame);
+    std::string forwardCommand(const std::string& command);
+    void stopReplication();
+    void applyDatagrams(const std::vector<std::pair<uint64_t, std::string>>& batch);
+    void startLoops();
+    int loopPollTimeout();
+    ThreadPool& loopPool();
+
+    void upgradeLoop();
+    bool handover(Socket peer);
 
     void server_business(DataBuffer,
                          LedServer::Client&);
+    bool streamBusiness(const DataBuffer& data, Client& client);
+    bool replicationBusiness(const std::string& input, Client& client);
+    static ReplicationLog& replicationLog();
+    std::string replicationSnapshot(uint64_t& seq);
+    bool applyReplicated(const std::string& command);
+    static bool isCommand(const std::string& input);
+    bool applyUpdate(const std::string& input);
+    DataBuffer exportState();
+    bool importState(const DataBuffer&);
 };
 
 /*!
@@ -92,10 +282,24 @@ struct LedServer {
 struct LedServer::Client : public LedClientBase {
     friend struct LedServer;
 
-    std::mutex access_mtx;
+    //! Защищает обработку клиента от доступа вне очереди strand.
+    ProfiledMutex access_mtx;
     SocketAddr_in address;
+    //! Очередь сообщений клиента, сохраняет их порядок.
+    std::shared_ptr<Strand> strand;
+    //! Подключен через unix сокет.
+    bool unix_domain = false;
+    //! Номер подключения в записи трафика.
+    uint32_t id = 0;
+    //! Потоковые передачи, доступ под access_mtx.
+    std::map<uint32_t, StreamTransfer> streams;
+    uint32_t last_stream = 0;
+    //! Байты фрагментов, принятые, но еще не обработанные.
+    std::atomic<size_t> stream_inflight = 0;
+    //! Задание отключения поставлено в очередь, доступ под client_mutex.
+    bool disconnect_posted = false;
 
-    Client(Socket socket, SocketAddr_in address);
+    Client(Socket socket, SocketAddr_in address, ThreadPool& pool);
     virtual ~Client() override;
     virtual mega_camera::SocketStatus getStatus()
     const override {
@@ -103,6 +307,7 @@ struct LedServer::Client : public LedClientBase {
     }
     virtual mega_camera::SocketStatus disconnect()
     override;
+    void detach();
 
     virtual SocketType getType() const override {
         return SocketType::server_socket;
@@ -0,0 +1,91 @@
+/*!
+ * \brief Транспорт через разделяемую память для клиентов на том же узле.
+*/
+#ifndef __SHM_CHANNEL_H__
+#define __SHM_CHANNEL_H__
+
+#include <ledctrl/general.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace mega_camera {
+
+//! Запрос клиента на переход к разделяемой памяти.
+static const char SHM_ATTACH_REQUEST[] = "shm-attach";
+//! Размер кольцевого буфера одного направления, степень двойки.
+static const uint32_t SHM_RING_SIZE = 1 << 18;
+//! Максимальное ожидание места в кольце, мс.
+static const int SHM_SEND_TIMEOUT = 1000;
+
+/*!
+ * \brief Заголовок кольцевого буфера в разделяемой памяти.
+ *
+ * head и tail - монотонные счетчики байтов, записанных и прочитанных. Они лежат в разных
+ * строках кэша, чтобы писатель и читатель не мешали друг другу.
+*/
+struct ShmRing {
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> writer_waiting;
+    uint32_t capacity;
+};
+
+/*!
+ * \brief Канал из двух колец SPSC в memfd.
+ *
+ * Одно кольцо для сообщений клиента серверу, второе - обратно. Сообщение в кольце
+ * имеет тот же формат, что и в сокете: длина (uint32_t) и данные. О новых данных
+ * писатель сообщает через eventfd читателя, который можно ждать в poll вместе с
+ * сокетами. Писатель при заполненном кольце ждет на futex по tail.
+ *
+ * Канал создается сервером; memfd и оба eventfd передаются клиенту через unix сокет
+ * (SCM_RIGHTS). Этот же unix сокет остается управляющим: его закрытие означает разрыв.
+ *
+ * Заголовки колец доступны другой стороне на запись, поэтому емкость берется из
+ * SHM_RING_SIZE, а head, tail и длины сообщений проверяются перед копированием.
+*/
+class ShmChannel {
+    int memfd;
+    int c2s_event;
+    int s2c_event;
+    void* mapping;
+    size_t mapping_size;
+    ShmRing* rx;
+    ShmRing* tx;
+    int rx_event;
+    int tx_event;
+    //! Емкость колец. Не читается из памяти, которую может изменить другая сторона.
+    uint32_t capacity;
+    bool server_side;
+    std::mutex send_mtx;
+
+    ShmChannel(int memfd, int c2s_event, int s2c_event, bool server_side);
+
+  public:
+    static std::shared_ptr<ShmChannel> create();
+    static std::shared_ptr<ShmChannel> attach(int memfd, int c2s_event, int s2c_event,
+                                              bool server_side);
+    ~ShmChannel();
+
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+
+    bool send(const void* data, uint32_t size);
+    DataBuffer receive(Socket control, bool& closed);
+
+    int eventFd() const {
+        return rx_event;
+    }
+
+    //! Дескрипторы для передачи другому процессу: memfd, c2s, s2c.
+    std::vector<int> fds() const {
+        return { memfd, c2s_event, s2c_event };
+    }
+};
+
+}
+
+#endif // __SHM_CHANNEL_H__
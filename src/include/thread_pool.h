@@ -8,75 +8,446 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
-#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "lock_profile.h"
+#include "logger.h"
+
+//! Классы приоритета заданий, в порядке убывания приоритета.
+enum class JobPriority : uint8_t {
+    control = 0,    //!< Прием соединений и данных, служебные задания
+    read,           //!< Команды чтения (get-*)
+    write           //!< Команды изменения (set-*)
+};
+
+static const size_t JOB_PRIORITY_COUNT = 3;
+
+//! Целевое время ожидания задания в очереди адаптивного пула.
+static const std::chrono::microseconds POOL_WAIT_TARGET(2000);
+//! Время простоя, после которого лишний поток адаптивного пула завершается.
+static const std::chrono::milliseconds POOL_IDLE_COOLDOWN(5000);
+
+//! Состояние очереди одного класса приоритета.
+struct LaneStats {
+    size_t queued;
+    size_t capacity;
+    uint64_t rejected;
+};
+
+//! Размер пула и счетчики изменения размера.
+struct PoolStats {
+    uint threads;       //!< Потоков сейчас
+    uint idle;          //!< Из них ждут задание
+    uint peak;          //!< Наибольшее число потоков
+    uint min_threads;   //!< Границы адаптивного режима, 0 - выключен
+    uint max_threads;
+    uint64_t grown;     //!< Добавлено потоков
+    uint64_t shrunk;    //!< Завершено простаивавших потоков
+    uint64_t wait_us;   //!< Сглаженное время ожидания задания в очереди, мкс
+};
+
+/*!
+ * \brief Разбор списка процессоров вида "0-3,8,10-11".
+ *
+ * \param[in] list Список.
+ * \return Номера процессоров, пустой вектор при ошибке.
+*/
+inline std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        std::string item = list.substr(pos, end == std::string::npos ? end : end - pos);
+        size_t dash = item.find('-');
+        try {
+            int first = std::stoi(item.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+            if (first < 0 || last < first)
+                return {};
+            for (int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        } catch (std::exception&) {
+            return {};
+        }
+        if (end == std::string::npos)
+            break;
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+/*!
+ * \brief Процессоры узла NUMA.
+ *
+ * \param[in] node Номер узла.
+ * \return Номера процессоров, пустой вектор, если узел не найден.
+*/
+inline std::vector<int> nodeCpuList(int node) {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+
+    if (not std::getline(file, list))
+        return {};
+    return parseCpuList(list);
+}
 
 /*!
  * \brief Класс пула потоков.
  *
  * При создании объекта выполняется N-ожидающих потоков. По мере добавления задачи
  * некоторые из потоков будут переходить к ее выполнению.
+ *
+ * Задания разделены на очереди по классам приоритета. Свободный поток берет задание из
+ * самой приоритетной непустой очереди, но после CONTROL_BURST служебных заданий подряд
+ * очередь control пропускается один раз. У каждой очереди есть емкость (0 - без
+ * ограничения): tryAddJob() отклоняет задание, если очередь заполнена.
+ *
+ * Потоки могут быть закреплены за процессорами (по кругу из списка cpus). С numa_local
+ * поток переходит на политику памяти MPOL_LOCAL до первого задания, поэтому его стек,
+ * арена malloc и буферы заданий размещаются на узле NUMA, где он выполняется.
+ *
+ * В адаптивном режиме (setAdaptive) число потоков меняется в заданных границах. Если
+ * задание ждало в очереди дольше целевого времени, а свободных потоков нет, пул
+ * добавляет поток, но не чаще раза за целевое время. Если свободные потоки не
+ * кончались дольше POOL_IDLE_COOLDOWN, освободившийся поток завершается, пока потоков
+ * больше нижней границы, - не чаще раза за то же время. Простой отдельного потока не
+ * подходит: самоперезапускающиеся циклы приема будят свободные потоки постоянно.
 */
 class ThreadPool {
+    //! Задание в очереди и время его постановки.
+    struct QueuedJob {
+        std::function<void()> job;
+        std::chrono::steady_clock::time_point queued;
+    };
+
     std::vector<std::thread> thread_pool;
-    std::queue<std::function<void()>> job_queue;
-    std::mutex queue_mtx;
-    std::condition_variable condition;
-    std::condition_variable stop_condition;
+    std::vector<int> cpus;
+    bool numa_local = false;
+    std::queue<QueuedJob> job_queue[JOB_PRIORITY_COUNT];
+    size_t lane_capacity[JOB_PRIORITY_COUNT] = { 0, 4096, 1024 };
+    uint64_t lane_rejected[JOB_PRIORITY_COUNT] = { 0, 0, 0 };
+    mega_camera::ProfiledMutex queue_mtx;
+    mega_camera::ProfiledCondition condition;
+    mega_camera::ProfiledCondition stop_condition;
+    mega_camera::ProfiledCondition idle_condition;
     std::atomic<bool> pool_terminated = false;
+    //! Задания сброшены, а wait() еще не вернулся. Доступ под queue_mtx.
+    bool jobs_dropped = false;
+    uint active_jobs = 0;
+    //! Число служебных заданий, взятых подряд.
+    uint control_streak = 0;
+    static const uint CONTROL_BURST = 2;
+
+    //! Адаптивный режим и его параметры.
+    bool adaptive = false;
+    uint min_threads = 0;
+    uint max_threads = 0;
+    std::chrono::microseconds wait_target = POOL_WAIT_TARGET;
+    std::chrono::milliseconds idle_cooldown = POOL_IDLE_COOLDOWN;
+    std::chrono::steady_clock::time_point last_grow = {};
+    //! Последний раз, когда задание взял последний свободный поток.
+    std::chrono::steady_clock::time_point last_saturated = {};
+    //! Завершившиеся потоки, которые еще не присоединены.
+    std::vector<std::thread::id> retired;
+    std::atomic<uint> live_threads = 0;
+    uint idle_threads = 0;
+    uint next_index = 0;
+    uint peak_threads = 0;
+    uint64_t grown_count = 0;
+    uint64_t shrunk_count = 0;
+    int64_t wait_average_ns = 0;
 
     void setupThreadPool(uint thread_count) {
+        std::unique_lock lock(queue_mtx);
         thread_pool.clear();
+        retired.clear();
         pool_terminated = false;
-        for (uint i = 0; i < thread_count; ++i) {
-            thread_pool.emplace_back(&ThreadPool::workerLoop, this);
+        live_threads = 0;
+        idle_threads = 0;
+        next_index = 0;
+        for (uint i = 0; i < thread_count; ++i)
+            spawnWorker();
+    }
+
+    //! Запуск потока, под queue_mtx.
+    void spawnWorker() {
+        thread_pool.emplace_back(&ThreadPool::workerLoop, this, next_index++);
+        ++live_threads;
+        peak_threads = std::max(peak_threads, live_threads.load());
+    }
+
+    //! Извлечение завершившихся потоков для присоединения, под queue_mtx.
+    void reapRetired(std::vector<std::thread>& finished) {
+        for (auto id : retired) {
+            auto it = std::find_if(thread_pool.begin(), thread_pool.end(),
+                [id](const std::thread& thread) {
+                    return thread.get_id() == id;
+                }
+            );
+            if (it != thread_pool.end()) {
+                finished.push_back(std::move(*it));
+                thread_pool.erase(it);
+            }
         }
+        retired.clear();
     }
 
-    void workerLoop() {
+    /*!
+     * \brief Добавление потока, если задание ждало слишком долго, под queue_mtx.
+     *
+     * \param[in] now Текущее время.
+     * \param[in] waited Ожидание задания в очереди.
+     * \param[out] finished Завершившиеся потоки для присоединения вне блокировки.
+    */
+    void growIfLate(std::chrono::steady_clock::time_point now,
+                    std::chrono::steady_clock::duration waited,
+                    std::vector<std::thread>& finished) {
+        if (not adaptive || pool_terminated || idle_threads != 0 ||
+                live_threads >= max_threads || waited <= wait_target ||
+                now - last_grow < wait_target)
+            return;
+        reapRetired(finished);
+        spawnWorker();
+        ++grown_count;
+        last_grow = now;
+    }
+
+    //! Лишний ли освободившийся поток, под queue_mtx.
+    bool shouldRetire() {
+        auto now = std::chrono::steady_clock::now();
+        if (not adaptive || live_threads <= min_threads ||
+                now - last_saturated < idle_cooldown)
+            return false;
+        last_saturated = now;
+        return true;
+    }
+
+    void placeWorker(uint index) {
+        if (not cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(static_cast<size_t>(cpus[index % cpus.size()]), &set);
+            if (sched_setaffinity(0, sizeof(set), &set) != 0)
+                mega_camera::logWarning("Unable to pin worker to CPU", {},
+                                        { { "cpu", cpus[index % cpus.size()] } });
+        }
+        if (numa_local)
+            syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0);
+    }
+
+    bool hasJobs() const {
+        for (const auto& lane : job_queue)
+            if (not lane.empty())
+                return true;
+        return false;
+    }
+
+    void workerLoop(uint index) {
+        placeWorker(index);
         std::function<void()> job;
+        std::vector<std::thread> finished;
         while (not pool_terminated) {
             {
                 std::unique_lock lock(queue_mtx);
-                condition.wait(lock,
-                    [this]() {
-                        return !job_queue.empty() || pool_terminated;
+                ++idle_threads;
+                while (not hasJobs() && not pool_terminated) {
+                    if (shouldRetire()) {
+                        // Лишний поток завершается, его присоединит следующий
+                        --idle_threads;
+                        --live_threads;
+                        ++shrunk_count;
+                        reapRetired(finished);
+                        retired.push_back(std::this_thread::get_id());
+                        lock.unlock();
+                        for (auto& thread : finished)
+                            thread.join();
+                        return;
                     }
-                );
-                if (pool_terminated)
+                    condition.wait_for(lock, idle_cooldown);
+                }
+                --idle_threads;
+                if (pool_terminated) {
+                    --live_threads;
                     return;
-                job = job_queue.front();
-                job_queue.pop();
+                }
+                // Самоперезапускающиеся служебные задания не должны вытеснять остальные
+                size_t first = control_streak >= CONTROL_BURST ? 1 : 0;
+                size_t lane = first;
+                while (lane < JOB_PRIORITY_COUNT && job_queue[lane].empty())
+                    ++lane;
+                if (lane == JOB_PRIORITY_COUNT)
+                    lane = 0;
+                control_streak = lane == 0 ? control_streak + 1 : 0;
+                auto now = std::chrono::steady_clock::now();
+                auto waited = now - job_queue[lane].front().queued;
+                job = std::move(job_queue[lane].front().job);
+                job_queue[lane].pop();
+                ++active_jobs;
+                if (idle_threads == 0)
+                    last_saturated = now;
+                wait_average_ns += (std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        waited).count() - wait_average_ns) / 16;
+                growIfLate(now, waited, finished);
             }
+            for (auto& thread : finished)
+                thread.join();
+            finished.clear();
             job();
+            job = nullptr;
+            {
+                std::unique_lock lock(queue_mtx);
+                --active_jobs;
+            }
+            idle_condition.notify_all();
         }
+        --live_threads;
     }
 
   public:
     ThreadPool(uint thread_count =
-                   std::thread::hardware_concurrency())
+                   std::thread::hardware_concurrency(),
+               std::vector<int> _cpus = {},
+               bool _numa_local = false)
         : thread_pool()
+        , cpus(std::move(_cpus))
+        , numa_local(_numa_local)
         , job_queue()
-        , queue_mtx()
+        , queue_mtx("pool.queue")
         , condition()
-        , stop_condition() {
+        , stop_condition()
+        , idle_condition()
+        , retired() {
         setupThreadPool(thread_count);
     }
 
     ~ThreadPool() {
         pool_terminated = true;
+        condition.notify_all();
         join();
     }
 
     template<typename F>
     void addJob(F job) {
+        tryAddJob(JobPriority::control, std::move(job), true);
+    }
+
+    /*!
+     * \brief Добавление задания в очередь класса приоритета.
+     *
+     * \param[in] priority Класс приоритета.
+     * \param[in] job Задание.
+     * \param[in] force Добавить независимо от емкости очереди.
+     * \return false, если очередь заполнена или пул остановлен.
+    */
+    template<typename F>
+    bool tryAddJob(JobPriority priority, F job, bool force = false) {
+        size_t lane = static_cast<size_t>(priority);
+        std::vector<std::thread> finished;
+
         if (pool_terminated)
-            return;
+            return false;
 
         {
             std::unique_lock lock(queue_mtx);
-            job_queue.push(std::function<void()>(job));
+            if (not force && lane_capacity[lane] &&
+                    job_queue[lane].size() >= lane_capacity[lane]) {
+                ++lane_rejected[lane];
+                return false;
+            }
+            auto now = std::chrono::steady_clock::now();
+            job_queue[lane].push({ std::function<void()>(std::move(job)), now });
+            // Все потоки заняты долгими заданиями: очередь проверяется при добавлении
+            if (adaptive && idle_threads == 0) {
+                auto oldest = now;
+                for (const auto& queue : job_queue)
+                    if (not queue.empty())
+                        oldest = std::min(oldest, queue.front().queued);
+                growIfLate(now, now - oldest, finished);
+            }
         }
         condition.notify_one();
+        for (auto& thread : finished)
+            thread.join();
+        return true;
+    }
+
+    //! Есть ли задания в очередях ниже control.
+    bool hasPendingWork() {
+        std::unique_lock lock(queue_mtx);
+        for (size_t lane = 1; lane < JOB_PRIORITY_COUNT; ++lane)
+            if (not job_queue[lane].empty())
+                return true;
+        return false;
+    }
+
+    /*!
+     * \brief Проверка емкости очереди без добавления задания.
+     *
+     * Для заданий, которые ждут в другой очереди (Strand) и попадут в пул позже.
+     * Отказ учитывается в счетчике отклоненных, как и в tryAddJob().
+     *
+     * \param[in] priority Класс приоритета.
+     * \return false, если очередь заполнена.
+    */
+    bool admitJob(JobPriority priority) {
+        size_t lane = static_cast<size_t>(priority);
+        std::unique_lock lock(queue_mtx);
+        if (lane_capacity[lane] && job_queue[lane].size() >= lane_capacity[lane]) {
+            ++lane_rejected[lane];
+            return false;
+        }
+        return true;
+    }
+
+    void setLaneCapacity(JobPriority priority, size_t capacity) {
+        std::unique_lock lock(queue_mtx);
+        lane_capacity[static_cast<size_t>(priority)] = capacity;
+    }
+
+    LaneStats getLaneStats(JobPriority priority) {
+        size_t lane = static_cast<size_t>(priority);
+        std::unique_lock lock(queue_mtx);
+        return { job_queue[lane].size(), lane_capacity[lane], lane_rejected[lane] };
+    }
+
+    /*!
+     * \brief Включение адаптивного размера пула.
+     *
+     * \param[in] _min_threads Нижняя граница, не меньше 1.
+     * \param[in] _max_threads Верхняя граница, 0 выключает адаптивный режим.
+     * \param[in] target Целевое время ожидания задания в очереди.
+     * \param[in] cooldown Время простоя до завершения лишнего потока.
+    */
+    void setAdaptive(uint _min_threads, uint _max_threads,
+                     std::chrono::microseconds target = POOL_WAIT_TARGET,
+                     std::chrono::milliseconds cooldown = POOL_IDLE_COOLDOWN) {
+        std::unique_lock lock(queue_mtx);
+        adaptive = _max_threads > 0;
+        max_threads = _max_threads;
+        min_threads = adaptive ? std::clamp(_min_threads, 1u, _max_threads) : 0;
+        wait_target = target;
+        idle_cooldown = cooldown;
+        last_saturated = std::chrono::steady_clock::now();
+        if (not pool_terminated)
+            while (live_threads < min_threads)
+                spawnWorker();
+    }
+
+    PoolStats getPoolStats() {
+        std::unique_lock lock(queue_mtx);
+        return {
+            live_threads, idle_threads, peak_threads, min_threads, max_threads,
+            grown_count, shrunk_count, static_cast<uint64_t>(wait_average_ns / 1000)
+        };
     }
 
     template<typename F, typename... Arg>
@@ -85,27 +456,42 @@ class ThreadPool {
     }
 
     void join() {
-        for (auto& thread : thread_pool) thread.join();
+        std::vector<std::thread> threads;
+        {
+            std::unique_lock lock(queue_mtx);
+            threads.swap(thread_pool);
+            retired.clear();
+        }
+        for (auto& thread : threads) thread.join();
     }
 
     uint getThreadCount() const {
-        return thread_pool.size();
+        return live_threads;
     }
 
     void dropUnstartedJobs() {
+        uint thread_count = live_threads;
         pool_terminated = true;
         condition.notify_all();
         join();
         // Отчистка заданий в очереди
-        std::queue<std::function<void()>> empty;
-        std::swap(job_queue, empty);
+        for (auto& lane : job_queue) {
+            std::queue<QueuedJob> empty;
+            std::swap(lane, empty);
+        }
+        {
+            // Флаг не дает потерять уведомление, если wait() вызван позже
+            std::lock_guard lock(queue_mtx);
+            jobs_dropped = true;
+        }
         stop_condition.notify_one();
         // Сброс пула
-        setupThreadPool(thread_pool.size());
+        setupThreadPool(thread_count);
     }
 
     void stop() {
         pool_terminated = true;
+        condition.notify_all();
         join();
     }
 
@@ -116,8 +502,126 @@ class ThreadPool {
         setupThreadPool(thread_count);
     }
 
+    /*!
+     * \brief Ожидание опустошения очереди.
+     *
+     * Возвращается, когда в очереди нет заданий и ни один поток не выполняет задание.
+     * Задания, которые перезапускают сами себя, должны быть остановлены до вызова.
+    */
+    void waitIdle() {
+        std::unique_lock lock(queue_mtx);
+        idle_condition.wait(lock,
+            [this]() {
+                return not hasJobs() && active_jobs == 0;
+            }
+        );
+    }
+
     void wait() {
         std::unique_lock lock(queue_mtx);
-        stop_condition.wait(lock);
+        stop_condition.wait(lock, [this]() { return jobs_dropped; });
+        jobs_dropped = false;
+    }
+};
+
+/*!
+ * \brief Последовательная очередь заданий поверх пула потоков.
+ *
+ * Задания одной очереди выполняются строго по порядку и никогда одновременно, но на
+ * любом свободном потоке пула. Ожидание предыдущего задания не занимает поток: пока
+ * очередь выполняется, новые задания только добавляются в нее. Чтобы одна очередь не
+ * занимала поток надолго, после STRAND_BATCH заданий она перепланируется в пул.
+ *
+ * Очередь планируется в пул с приоритетом своего первого задания. Длина очереди
+ * ограничена STRAND_CAPACITY, новое задание также отклоняется при заполненной
+ * очереди пула его приоритета.
+*/
+class Strand : public std::enable_shared_from_this<Strand> {
+    static const uint STRAND_BATCH = 16;
+    static const size_t STRAND_CAPACITY = 256;
+
+    ThreadPool& pool;
+    std::mutex strand_mtx;
+    std::queue<std::pair<JobPriority, std::function<void()>>> jobs;
+    bool running = false;
+
+    void drain() {
+        JobPriority next;
+        for (uint done = 0; done < STRAND_BATCH; ++done) {
+            std::function<void()> job;
+            {
+                std::lock_guard lock(strand_mtx);
+                if (jobs.empty()) {
+                    running = false;
+                    return;
+                }
+                job = std::move(jobs.front().second);
+                jobs.pop();
+            }
+            job();
+        }
+        {
+            std::lock_guard lock(strand_mtx);
+            if (jobs.empty()) {
+                running = false;
+                return;
+            }
+            next = jobs.front().first;
+        }
+        // Задания уже приняты, поэтому емкость очереди пула не проверяется
+        pool.tryAddJob(next, [self = shared_from_this()] { self->drain(); }, true);
+    }
+
+  public:
+    explicit Strand(ThreadPool& _pool)
+        : pool(_pool)
+        , strand_mtx()
+        , jobs() {}
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    /*!
+     * \brief Добавление задания.
+     *
+     * \param[in] job Задание.
+     * \param[in] priority Класс приоритета.
+     * \param[in] force Добавить независимо от емкости очередей.
+     * \return false, если задание отклонено.
+    */
+    template<typename F>
+    bool post(F job, JobPriority priority = JobPriority::control,
+              bool force = false) {
+        {
+            std::lock_guard lock(strand_mtx);
+            if (running) {
+                // Очередь пула проверяется и здесь, иначе занятый клиент обходил бы
+                // ее емкость, копя задания в своей очереди
+                if (not force && (jobs.size() >= STRAND_CAPACITY ||
+                                  not pool.admitJob(priority)))
+                    return false;
+                jobs.emplace(priority, std::function<void()>(std::move(job)));
+                return true;
+            }
+            jobs.emplace(priority, std::function<void()>(std::move(job)));
+            running = true;
+        }
+        if (pool.tryAddJob(priority, [self = shared_from_this()] { self->drain(); },
+                           force))
+            return true;
+
+        // Пока пул отклонял задание, в очередь могли добавить следующие
+        JobPriority next;
+        {
+            std::lock_guard lock(strand_mtx);
+            jobs.pop();
+            if (jobs.empty()) {
+                running = false;
+                return false;
+            }
+            next = jobs.front().first;
+        }
+        pool.tryAddJob(next, [self = shared_from_this()] { self->drain(); }, true);
+        return false;
     }
 };
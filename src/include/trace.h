@@ -0,0 +1,111 @@
+/*!
+ * \brief Трассировка обработки запросов.
+ *
+ * Участки обработки запроса (ожидание в очереди, ожидание access_mtx, обработчик,
+ * запись журнала, отправка ответа) записываются в кольцевые буферы потоков и
+ * выгружаются в формате Chrome trace event JSON, который открывает Perfetto.
+ *
+ * Трассировка собирается при определенном LEDCTRL_TRACING (опция CMake) и включается
+ * во время работы. Выключенная трассировка стоит одной атомарной проверки на участок.
+ * Без LEDCTRL_TRACING функции ниже - пустые заглушки.
+*/
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace mega_camera {
+
+#ifdef LEDCTRL_TRACING
+
+//! Число участков в кольце одного потока, степень двойки.
+static const size_t TRACE_RING_SIZE = 1 << 14;
+
+//! Трассировка включена.
+extern std::atomic<bool> trace_enabled;
+
+inline bool tracingEnabled() {
+    return trace_enabled.load(std::memory_order_relaxed);
+}
+
+void setTracing(bool enabled);
+uint64_t traceNow();
+uint64_t traceNextRequest();
+void traceSpan(const char* name, uint64_t begin, uint64_t end);
+bool traceDump(const std::string& path);
+
+/*!
+ * \brief Запрос, к которому относятся участки текущего потока.
+ *
+ * Восстанавливает предыдущий запрос при выходе из области.
+*/
+class TraceRequest {
+    uint64_t previous;
+
+  public:
+    explicit TraceRequest(uint64_t request);
+    ~TraceRequest();
+
+    TraceRequest(const TraceRequest&) = delete;
+    TraceRequest& operator=(const TraceRequest&) = delete;
+};
+
+/*!
+ * \brief Участок от создания до выхода из области.
+*/
+class TraceScope {
+    const char* name;
+    uint64_t begin;
+
+  public:
+    explicit TraceScope(const char* _name)
+        : name(_name), begin(tracingEnabled() ? traceNow() : 0) {}
+
+    ~TraceScope() {
+        if (begin)
+            traceSpan(name, begin, traceNow());
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+#else
+
+inline bool tracingEnabled() {
+    return false;
+}
+
+inline void setTracing(bool) {}
+
+inline uint64_t traceNow() {
+    return 0;
+}
+
+inline uint64_t traceNextRequest() {
+    return 0;
+}
+
+inline void traceSpan(const char*, uint64_t, uint64_t) {}
+
+inline bool traceDump(const std::string&) {
+    return false;
+}
+
+class TraceRequest {
+  public:
+    explicit TraceRequest(uint64_t) {}
+};
+
+class TraceScope {
+  public:
+    explicit TraceScope(const char*) {}
+};
+
+#endif // LEDCTRL_TRACING
+
+}
+
+#endif // __TRACE_H__
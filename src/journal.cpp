@@ -0,0 +1,359 @@
+/*!
+ * \brief Реализация журнала изменяющих команд.
+*/
+#include "journal.h"
+#include "logger.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include <cstring>
+
+using namespace mega_camera;
+
+/*!
+ * \brief Контрольная сумма FNV-1a.
+*/
+static uint32_t checksum(const char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*!
+ * \brief Запись буфера целиком.
+*/
+static bool writeAll(int fd, const std::string& buffer) {
+    size_t done = 0;
+    while (done < buffer.size()) {
+        ssize_t answ = write(fd, buffer.data() + done, buffer.size() - done);
+        if (answ < 0 && errno == EINTR)
+            continue;
+        if (answ <= 0)
+            return false;
+        done += static_cast<size_t>(answ);
+    }
+    return true;
+}
+
+Journal::Journal()
+    : fd(-1)
+    , path()
+    , file_size(0)
+    , compact_threshold(JOURNAL_COMPACT_THRESHOLD)
+    , snapshot()
+    , writer()
+    , mtx()
+    , pending_condition()
+    , durable_condition()
+    , pending()
+    , appended_seq(0)
+    , durable_seq(0)
+    , failed_seq(0)
+    , compact_requested(0)
+    , compact_done(0)
+    , opened(false)
+    , failed(false)
+    , terminated(false)
+{}
+
+Journal::~Journal() {
+    close();
+}
+
+void Journal::encode(const std::string& record, std::string& out) {
+    uint32_t header[2] = {
+        static_cast<uint32_t>(record.size()),
+        checksum(record.data(), record.size())
+    };
+    out.append(reinterpret_cast<const char*>(header), sizeof(header));
+    out.append(record);
+}
+
+/*!
+ * \brief Открытие журнала.
+ *
+ * Существующие записи повторяются через replay_fn, затем журнал сжимается в снимок
+ * и запускается поток записи.
+ *
+ * \param[in] journal_path Путь к файлу журнала.
+ * \param[in] replay_fn Применение записи при повторе.
+ * \param[in] snapshot_fn Построение снимка для сжатия.
+ * \param[in] threshold Размер журнала, после которого он сжимается автоматически.
+ * \return Статус операции.
+*/
+bool Journal::open(const std::string& journal_path, replay_function_t replay_fn,
+                   snapshot_function_t snapshot_fn, size_t threshold) {
+    if (fd != -1 || writer.joinable())
+        return false;
+
+    path = journal_path;
+    snapshot = snapshot_fn;
+    compact_threshold = threshold;
+    failed = false;
+    terminated = false;
+
+    if ((fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+        return false;
+
+    if (not replay(replay_fn) || not rewrite(snapshot())) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    writer = std::thread(&Journal::writerLoop, this);
+    std::lock_guard lock(mtx);
+    opened = true;
+    return true;
+}
+
+/*!
+ * \brief Остановка журнала.
+ *
+ * Записи, поставленные в очередь до вызова, будут записаны.
+*/
+void Journal::close() {
+    {
+        std::lock_guard lock(mtx);
+        terminated = true;
+        opened = false;
+    }
+    pending_condition.notify_all();
+    if (writer.joinable())
+        writer.join();
+    if (fd != -1)
+        ::close(fd);
+    fd = -1;
+}
+
+/*!
+ * \brief Повтор записей журнала.
+ *
+ * Чтение останавливается на первой поврежденной или неполной записи, хвост после
+ * нее отбрасывается.
+*/
+bool Journal::replay(replay_function_t replay_fn) {
+    std::string data;
+    char chunk[65536];
+    ssize_t answ;
+
+    while ((answ = read(fd, chunk, sizeof(chunk))) > 0)
+        data.append(chunk, static_cast<size_t>(answ));
+    if (answ < 0)
+        return false;
+
+    size_t offset = 0;
+    while (data.size() - offset >= 2 * sizeof(uint32_t)) {
+        uint32_t header[2];
+        memcpy(header, data.data() + offset, sizeof(header));
+        if (header[0] > data.size() - offset - sizeof(header))
+            break;
+        const char* record = data.data() + offset + sizeof(header);
+        if (checksum(record, header[0]) != header[1])
+            break;
+        replay_fn(std::string(record, header[0]));
+        offset += sizeof(header) + header[0];
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Атомарная замена журнала набором записей.
+ *
+ * Записи пишутся во временный файл, который после fdatasync переименовывается
+ * поверх журнала. Вызывается только потоком записи или до его запуска.
+*/
+bool Journal::rewrite(const std::vector<std::string>& records) {
+    std::string tmp_path = path + ".tmp";
+    std::string buffer;
+
+    for (const auto& record : records)
+        encode(record, buffer);
+
+    int tmp = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tmp == -1)
+        return false;
+
+    if (not writeAll(tmp, buffer) || fdatasync(tmp) != 0 ||
+            rename(tmp_path.c_str(), path.c_str()) != 0) {
+        ::close(tmp);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    // Переименование должно пережить сбой
+    std::string dir_path = path;
+    int dir = ::open(dirname(&dir_path[0]), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir != -1) {
+        fsync(dir);
+        ::close(dir);
+    }
+
+    ::close(fd);
+    fd = tmp;
+    file_size = buffer.size();
+    return true;
+}
+
+/*!
+ * \brief Постановка записи в очередь.
+ *
+ * Вызывающий должен ставить записи в том же порядке, в котором применяет изменения.
+ *
+ * \param[in] record Запись.
+ * \return Номер записи для waitDurable(), 0 если журнал закрыт.
+*/
+uint64_t Journal::append(std::string record) {
+    uint64_t ticket;
+    {
+        std::lock_guard lock(mtx);
+        if (not opened || terminated)
+            return 0;
+        pending.push_back(std::move(record));
+        ticket = ++appended_seq;
+    }
+    pending_condition.notify_one();
+    return ticket;
+}
+
+/*!
+ * \brief Номер последней поставленной записи.
+ *
+ * Ожидание этого номера гарантирует, что все изменения, уже видимые в состоянии,
+ * записаны на диск.
+ *
+ * \return Номер записи для waitDurable(), 0 если журнал закрыт.
+*/
+uint64_t Journal::lastTicket() {
+    std::lock_guard lock(mtx);
+    if (not opened || terminated)
+        return 0;
+    return appended_seq;
+}
+
+/*!
+ * \brief Ожидание записи на диск.
+ *
+ * \param[in] ticket Номер записи из append().
+ * \return false, если запись журнала завершилась ошибкой.
+*/
+bool Journal::waitDurable(uint64_t ticket) {
+    if (ticket == 0)
+        return true;
+
+    std::unique_lock lock(mtx);
+    durable_condition.wait(lock,
+        [this, ticket]() {
+            return durable_seq >= ticket || failed_seq >= ticket;
+        }
+    );
+    return durable_seq >= ticket;
+}
+
+/*!
+ * \brief Сжатие журнала в снимок.
+ *
+ * Выполняется потоком записи, вызывающий ожидает завершения.
+*/
+bool Journal::compact() {
+    std::unique_lock lock(mtx);
+    if (not opened || terminated)
+        return false;
+
+    uint64_t request = ++compact_requested;
+    pending_condition.notify_one();
+    durable_condition.wait(lock,
+        [this, request]() {
+            return compact_done >= request || terminated;
+        }
+    );
+    return not failed;
+}
+
+/*!
+ * \brief Путь к файлу открытого журнала.
+ *
+ * \return Путь, пустая строка если журнал закрыт.
+*/
+std::string Journal::openedPath() {
+    std::lock_guard lock(mtx);
+    return opened ? path : std::string();
+}
+
+/*!
+ * \brief Поток групповой фиксации.
+ *
+ * После ошибки записи хвост файла может быть испорчен, и повтор остановился бы на
+ * нем. Поэтому записи больше не дописываются: каждое пробуждение потока пробует
+ * сжатие, снимок которого содержит и потерянные записи. После успешного сжатия
+ * журнал снова работает как обычно.
+*/
+void Journal::writerLoop() {
+    std::unique_lock lock(mtx);
+
+    for (;;) {
+        pending_condition.wait(lock,
+            [this]() {
+                return not pending.empty() || terminated ||
+                       compact_requested != compact_done;
+            }
+        );
+
+        if (not pending.empty() && not failed) {
+            std::vector<std::string> batch;
+            std::string buffer;
+            uint64_t last = appended_seq;
+
+            batch.swap(pending);
+            lock.unlock();
+            for (const auto& record : batch)
+                encode(record, buffer);
+            bool ok = writeAll(fd, buffer) && fdatasync(fd) == 0;
+            lock.lock();
+
+            if (ok) {
+                durable_seq = last;
+                file_size += buffer.size();
+            } else {
+                failed = true;
+                failed_seq = last;
+                logError("Journal write failed", path);
+            }
+            durable_condition.notify_all();
+        }
+
+        if (compact_requested != compact_done || failed ||
+                file_size > compact_threshold) {
+            uint64_t request = compact_requested;
+            // Изменения поставленных записей уже в состоянии и войдут в снимок
+            uint64_t last = appended_seq;
+            pending.clear();
+            lock.unlock();
+            bool ok = rewrite(snapshot());
+            lock.lock();
+
+            if (ok) {
+                if (failed)
+                    logInfo("Journal recovered by compaction", path);
+                failed = false;
+                durable_seq = last;
+            } else {
+                if (not failed)
+                    logError("Journal compaction failed", path);
+                failed = true;
+                failed_seq = last;
+            }
+            compact_done = request;
+            durable_condition.notify_all();
+        }
+
+        if (terminated && pending.empty())
+            return;
+    }
+}
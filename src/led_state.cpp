@@ -0,0 +1,204 @@
+/*!
+ * \brief Реализация хранилища состояния светодиодов.
+*/
+#include "led_state.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <new>
+
+using namespace mega_camera;
+
+//! Запись устройства в файле версии 1, до появления эффектов.
+struct LedV1 {
+    enum LedState state;
+    enum LedColor color;
+    LedRate rate;
+};
+
+/*!
+ * \brief Проверка заголовка файла состояния.
+*/
+static bool validHeader(const LedStateHeader* header, uint16_t version) {
+    return header->magic == LED_STATE_MAGIC && header->version == version &&
+           header->header_size == sizeof(LedStateHeader) &&
+           header->capacity == LED_MAX_DEVICES &&
+           header->count >= 1 && header->count <= LED_MAX_DEVICES;
+}
+
+size_t LedStateStore::mappingSize() {
+    return sizeof(LedStateHeader) + LED_MAX_DEVICES * sizeof(Led);
+}
+
+LedStateStore::LedStateStore()
+    : header(nullptr)
+    , table(nullptr)
+    , mapped_size(mappingSize())
+    , fd(-1)
+    , sync_thread()
+    , sync_mtx()
+    , sync_condition()
+    , sync_terminated(false) {
+    void* memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::bad_alloc();
+    header = static_cast<LedStateHeader*>(memory);
+    table = reinterpret_cast<Led*>(header + 1);
+    initialize(nullptr);
+}
+
+LedStateStore::~LedStateStore() {
+    stopPeriodicSync();
+    sync();
+    unmap();
+}
+
+/*!
+ * \brief Заполнение заголовка и таблицы.
+ *
+ * \param[in] from Отображение, из которого копируется таблица, или nullptr.
+*/
+void LedStateStore::initialize(const LedStateHeader* from) {
+    header->magic = LED_STATE_MAGIC;
+    header->version = LED_STATE_VERSION;
+    header->header_size = sizeof(LedStateHeader);
+    header->capacity = LED_MAX_DEVICES;
+
+    if (from) {
+        header->count = from->count;
+        header->generation = from->generation;
+        memcpy(table, from + 1, LED_MAX_DEVICES * sizeof(Led));
+        return;
+    }
+
+    header->count = 1;
+    header->generation = 0;
+    for (uint32_t i = 0; i < LED_MAX_DEVICES; ++i)
+        table[i] = LED_DEFAULT;
+}
+
+/*!
+ * \brief Перевод отображенного файла версии 1 в текущий формат.
+ *
+ * Таблица версии 1 лежит сразу за тем же заголовком, эффект устройств - NONE.
+*/
+void LedStateStore::migrateV1() {
+    LedV1 previous[LED_MAX_DEVICES];
+
+    memcpy(previous, table, sizeof(previous));
+    for (uint32_t i = 0; i < LED_MAX_DEVICES; ++i)
+        table[i] = { previous[i].state, previous[i].color, previous[i].rate, NONE };
+    header->version = LED_STATE_VERSION;
+}
+
+void LedStateStore::unmap() {
+    if (header)
+        munmap(header, mapped_size);
+    if (fd != -1)
+        close(fd);
+    header = nullptr;
+    table = nullptr;
+    fd = -1;
+}
+
+/*!
+ * \brief Отображение файла состояния.
+ *
+ * Если файл содержит заголовок текущей версии, состояние берется из него, файл
+ * версии 1 переводится в текущий формат. Иначе файл инициализируется текущим
+ * состоянием. Вызывается до startPeriodicSync().
+ *
+ * \param[in] path Путь к файлу.
+ * \param[out] restored Состояние восстановлено из файла.
+ * \return Статус операции.
+*/
+bool LedStateStore::open(const std::string& path, bool& restored) {
+    struct stat st;
+
+    restored = false;
+    int file = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (file == -1)
+        return false;
+
+    if (fstat(file, &st) == -1 ||
+            (static_cast<size_t>(st.st_size) < mapped_size &&
+             ftruncate(file, static_cast<off_t>(mapped_size)) == -1)) {
+        close(file);
+        return false;
+    }
+
+    void* memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, file, 0);
+    if (memory == MAP_FAILED) {
+        close(file);
+        return false;
+    }
+
+    LedStateHeader* previous_header = header;
+    int previous_fd = fd;
+
+    header = static_cast<LedStateHeader*>(memory);
+    table = reinterpret_cast<Led*>(header + 1);
+    fd = file;
+
+    restored = validHeader(header, LED_STATE_VERSION);
+    if (not restored && validHeader(header, 1)) {
+        migrateV1();
+        restored = true;
+    }
+    if (not restored)
+        initialize(previous_header);
+
+    if (previous_fd != -1) {
+        msync(previous_header, mapped_size, MS_SYNC);
+        close(previous_fd);
+    }
+    munmap(previous_header, mapped_size);
+
+    return true;
+}
+
+/*!
+ * \brief Сброс отображения на диск.
+ *
+ * \return Статус операции.
+*/
+bool LedStateStore::sync() {
+    if (fd == -1)
+        return true;
+    return msync(header, mapped_size, MS_SYNC) == 0;
+}
+
+/*!
+ * \brief Запуск периодического msync.
+ *
+ * \param[in] interval Период синхронизации.
+*/
+void LedStateStore::startPeriodicSync(std::chrono::milliseconds interval) {
+    stopPeriodicSync();
+    sync_terminated = false;
+    sync_thread = std::thread(&LedStateStore::syncLoop, this, interval);
+}
+
+void LedStateStore::stopPeriodicSync() {
+    if (not sync_thread.joinable())
+        return;
+    {
+        std::lock_guard lock(sync_mtx);
+        sync_terminated = true;
+    }
+    sync_condition.notify_all();
+    sync_thread.join();
+}
+
+void LedStateStore::syncLoop(std::chrono::milliseconds interval) {
+    std::unique_lock lock(sync_mtx);
+    while (not sync_condition.wait_for(lock, interval,
+                                       [this]() { return sync_terminated; }))
+        sync();
+}
@@ -0,0 +1,256 @@
+/*!
+ * \brief Реализация профилирования блокировок.
+*/
+#include "lock_profile.h"
+
+#ifdef LEDCTRL_LOCK_PROFILING
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <vector>
+
+using namespace mega_camera;
+
+namespace mega_camera {
+
+/*!
+ * \brief Счетчики одной части LockStats.
+ *
+ * Части выровнены по строке кэша: потоки, захватывающие одну блокировку, пишут
+ * каждый в свою часть и не делят строки со счетчиками.
+*/
+struct alignas(64) LockCounters {
+    std::atomic<uint64_t> acquired;
+    std::atomic<uint64_t> contended;
+    std::atomic<uint64_t> wait_ns;
+    std::atomic<uint64_t> wait_max;
+    std::atomic<uint64_t> hold_ns;
+    std::atomic<uint64_t> hold_max;
+    std::atomic<uint64_t> wait_histogram[LOCK_HISTOGRAM_SIZE];
+    std::atomic<uint64_t> hold_histogram[LOCK_HISTOGRAM_SIZE];
+
+    LockCounters()
+        : acquired(0), contended(0), wait_ns(0), wait_max(0), hold_ns(0), hold_max(0)
+        , wait_histogram(), hold_histogram() {}
+};
+
+//! Счетчики блокировок с одним именем, по частям на потоки.
+struct LockStats {
+    std::string name;
+    LockCounters shards[LOCK_STATS_SHARDS];
+
+    explicit LockStats(const char* _name) : name(_name), shards() {}
+};
+
+}
+
+namespace {
+
+/*!
+ * \brief Счетчики всех блокировок по именам.
+ *
+ * Блокировки создаются и при статической инициализации (cons_mutex), поэтому реестр -
+ * локальная статическая переменная. Счетчики живут до конца процесса.
+*/
+struct LockRegistry {
+    std::mutex mtx;
+    std::map<std::string, std::unique_ptr<LockStats>> locks;
+
+    LockRegistry() : mtx(), locks() {}
+};
+
+LockRegistry& registry() {
+    static LockRegistry instance;
+    return instance;
+}
+
+//! Счетчики блокировки по имени, создаются при первом обращении.
+LockStats& lockStats(const char* name) {
+    LockRegistry& all = registry();
+    std::lock_guard lock(all.mtx);
+    std::unique_ptr<LockStats>& stats = all.locks[name];
+    if (not stats)
+        stats.reset(new LockStats(name));
+    return *stats;
+}
+
+std::atomic<size_t> next_shard = 0;
+thread_local size_t local_shard = next_shard++ % LOCK_STATS_SHARDS;
+
+//! Часть счетчиков текущего потока.
+LockCounters& localCounters(LockStats& stats) {
+    return stats.shards[local_shard];
+}
+
+uint64_t lockNow() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+size_t histogramIndex(uint64_t ns) {
+    size_t index = ns ? static_cast<size_t>(64 - __builtin_clzll(ns)) : 0;
+    return std::min(index, LOCK_HISTOGRAM_SIZE - 1);
+}
+
+void record(std::atomic<uint64_t>* histogram, std::atomic<uint64_t>& total,
+            std::atomic<uint64_t>& max, uint64_t ns) {
+    histogram[histogramIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t current = max.load(std::memory_order_relaxed);
+    while (ns > current &&
+           not max.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {}
+}
+
+/*!
+ * \brief Верхняя граница интервала гистограммы, в который попадает квантиль.
+*/
+uint64_t quantile(const uint64_t* histogram, uint64_t count, double q) {
+    uint64_t target = static_cast<uint64_t>(static_cast<double>(count) * q);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LOCK_HISTOGRAM_SIZE; ++i) {
+        seen += histogram[i];
+        if (seen > target)
+            return i ? uint64_t(1) << i : 0;
+    }
+    return uint64_t(1) << (LOCK_HISTOGRAM_SIZE - 1);
+}
+
+//! Сумма частей счетчиков одной блокировки.
+struct LockTotals {
+    const char* name;
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t wait_max;
+    uint64_t hold_ns;
+    uint64_t hold_max;
+    uint64_t wait_histogram[LOCK_HISTOGRAM_SIZE];
+    uint64_t hold_histogram[LOCK_HISTOGRAM_SIZE];
+};
+
+LockTotals lockTotals(const LockStats& stats) {
+    LockTotals totals = {};
+    totals.name = stats.name.c_str();
+    for (const LockCounters& shard : stats.shards) {
+        totals.acquired += shard.acquired.load(std::memory_order_relaxed);
+        totals.contended += shard.contended.load(std::memory_order_relaxed);
+        totals.wait_ns += shard.wait_ns.load(std::memory_order_relaxed);
+        totals.wait_max = std::max(totals.wait_max,
+                                   shard.wait_max.load(std::memory_order_relaxed));
+        totals.hold_ns += shard.hold_ns.load(std::memory_order_relaxed);
+        totals.hold_max = std::max(totals.hold_max,
+                                   shard.hold_max.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < LOCK_HISTOGRAM_SIZE; ++i) {
+            totals.wait_histogram[i] += shard.wait_histogram[i].load(std::memory_order_relaxed);
+            totals.hold_histogram[i] += shard.hold_histogram[i].load(std::memory_order_relaxed);
+        }
+    }
+    return totals;
+}
+
+}
+
+ProfiledMutex::ProfiledMutex(const char* name)
+    : mtx(), stats(lockStats(name)), acquired(0) {}
+
+void ProfiledMutex::lock() {
+    uint64_t wait = 0;
+    bool contended = not mtx.try_lock();
+    if (contended) {
+        uint64_t begin = lockNow();
+        mtx.lock();
+        wait = lockNow() - begin;
+    }
+    LockCounters& counters = localCounters(stats);
+    if (contended)
+        counters.contended.fetch_add(1, std::memory_order_relaxed);
+    counters.acquired.fetch_add(1, std::memory_order_relaxed);
+    record(counters.wait_histogram, counters.wait_ns, counters.wait_max, wait);
+    acquired = lockNow();
+}
+
+bool ProfiledMutex::try_lock() {
+    if (not mtx.try_lock())
+        return false;
+    LockCounters& counters = localCounters(stats);
+    counters.acquired.fetch_add(1, std::memory_order_relaxed);
+    record(counters.wait_histogram, counters.wait_ns, counters.wait_max, 0);
+    acquired = lockNow();
+    return true;
+}
+
+void ProfiledMutex::unlock() {
+    uint64_t hold = lockNow() - acquired;
+    mtx.unlock();
+    LockCounters& counters = localCounters(stats);
+    record(counters.hold_histogram, counters.hold_ns, counters.hold_max, hold);
+}
+
+/*!
+ * \brief Отчет по блокировкам.
+ *
+ * Строка на имя, по убыванию суммарного ожидания: захваты, захваты с ожиданием,
+ * среднее, p50, p99 и наибольшее время ожидания и удержания в нс. Квантили - верхние
+ * границы интервалов гистограммы.
+*/
+std::string mega_camera::lockProfileReport() {
+    std::vector<LockTotals> locks;
+    {
+        LockRegistry& all = registry();
+        std::lock_guard lock(all.mtx);
+        for (const auto& [name, stats] : all.locks)
+            locks.push_back(lockTotals(*stats));
+    }
+    std::sort(locks.begin(), locks.end(),
+        [](const LockTotals& left, const LockTotals& right) {
+            return left.wait_ns > right.wait_ns;
+        });
+
+    std::string report;
+    for (const LockTotals& stats : locks) {
+        if (stats.acquired == 0)
+            continue;
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "%s acquired=%" PRIu64 " contended=%" PRIu64
+                 " wait avg=%" PRIu64 " p50=%" PRIu64 " p99=%" PRIu64 " max=%" PRIu64
+                 " hold avg=%" PRIu64 " p50=%" PRIu64 " p99=%" PRIu64 " max=%" PRIu64 "\n",
+                 stats.name, stats.acquired, stats.contended,
+                 stats.wait_ns / stats.acquired,
+                 quantile(stats.wait_histogram, stats.acquired, 0.5),
+                 quantile(stats.wait_histogram, stats.acquired, 0.99), stats.wait_max,
+                 stats.hold_ns / stats.acquired,
+                 quantile(stats.hold_histogram, stats.acquired, 0.5),
+                 quantile(stats.hold_histogram, stats.acquired, 0.99), stats.hold_max);
+        report += line;
+    }
+    return report;
+}
+
+/*!
+ * \brief Обнуление счетчиков всех блокировок.
+*/
+void mega_camera::lockProfileReset() {
+    LockRegistry& all = registry();
+    std::lock_guard lock(all.mtx);
+    for (auto& [name, stats] : all.locks) {
+        for (LockCounters& shard : stats->shards) {
+            shard.acquired = 0;
+            shard.contended = 0;
+            shard.wait_ns = 0;
+            shard.wait_max = 0;
+            shard.hold_ns = 0;
+            shard.hold_max = 0;
+            for (size_t i = 0; i < LOCK_HISTOGRAM_SIZE; ++i) {
+                shard.wait_histogram[i] = 0;
+                shard.hold_histogram[i] = 0;
+            }
+        }
+    }
+}
+
+#endif // LEDCTRL_LOCK_PROFILING
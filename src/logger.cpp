@@ -0,0 +1,312 @@
+/*!
+ * \brief Реализация асинхронного журнала сообщений.
+*/
+#include "logger.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace mega_camera;
+
+std::atomic<LogLevel> mega_camera::log_level = LogLevel::info;
+
+namespace {
+
+const char* const LEVEL_NAMES[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+//! Поле в записи кольца.
+struct RecordField {
+    const char* name;
+    int64_t value;
+    const char* text;
+};
+
+//! Запись кольца.
+struct LogRecord {
+    uint64_t time_ns;
+    const char* message;
+    RecordField fields[LOG_FIELDS];
+    uint8_t field_count;
+    LogLevel level;
+    bool truncated;
+    uint8_t text_size;
+    char text[LOG_TEXT_SIZE];
+};
+
+/*!
+ * \brief Кольцо записей одного потока.
+ *
+ * Один писатель (поток-владелец) и один читатель (вывод под Logger::mtx). Запись
+ * публикуется через head с release, освобождение места - через tail с release.
+ * Кольцо завершившегося потока переходит к новому потоку.
+*/
+struct LogRing {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> owned;
+    LogRecord records[LOG_RING_SIZE];
+};
+
+//! Кольца и поток вывода. Не разрушается: потоки могут писать до самого выхода.
+struct Logger {
+    std::mutex mtx;
+    std::condition_variable condition;
+    std::vector<std::unique_ptr<LogRing>> rings;
+    std::vector<LogRecord> batch;
+    std::string output;
+    int fd;
+    bool started;
+    uint64_t written;
+    uint64_t reported_dropped;
+
+    Logger()
+        : mtx(), condition(), rings(), batch(), output(), fd(STDERR_FILENO)
+        , started(false), written(0), reported_dropped(0) {}
+};
+
+Logger& logger() {
+    static Logger* instance = new Logger();
+    return *instance;
+}
+
+//! Отдает кольцо при завершении потока.
+struct LocalRing {
+    LogRing* ring = nullptr;
+
+    ~LocalRing() {
+        if (ring)
+            ring->owned.store(false, std::memory_order_release);
+    }
+};
+
+thread_local LocalRing local_ring;
+
+uint64_t logNow() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+void appendText(std::string& output, const char* text, size_t size) {
+    while (size && (text[size - 1] == '\n' || text[size - 1] == ' '))
+        --size;
+    for (size_t i = 0; i < size; ++i) {
+        unsigned char symbol = static_cast<unsigned char>(text[i]);
+        output += symbol < 0x20 || symbol == 0x7f ? '.' : text[i];
+    }
+}
+
+void formatRecord(std::string& output, const LogRecord& record) {
+    time_t seconds = static_cast<time_t>(record.time_ns / 1000000000);
+    tm local;
+    char prefix[64];
+    localtime_r(&seconds, &local);
+    size_t size = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &local);
+    snprintf(prefix + size, sizeof(prefix) - size, ".%06u %s ",
+             static_cast<unsigned>(record.time_ns % 1000000000 / 1000),
+             LEVEL_NAMES[static_cast<size_t>(record.level)]);
+
+    output += prefix;
+    output += record.message;
+    if (record.text_size) {
+        output += ' ';
+        appendText(output, record.text, record.text_size);
+        if (record.truncated)
+            output += "...";
+    }
+    for (size_t i = 0; i < record.field_count; ++i) {
+        const RecordField& field = record.fields[i];
+        output += ' ';
+        output += field.name;
+        output += '=';
+        output += field.text ? field.text : std::to_string(field.value);
+    }
+    output += '\n';
+}
+
+/*!
+ * \brief Вывод накопленных записей всех колец, под Logger::mtx.
+*/
+void drain(Logger& log) {
+    uint64_t dropped = 0;
+
+    log.batch.clear();
+    for (auto& ring : log.rings) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail)
+            log.batch.push_back(ring->records[tail & (LOG_RING_SIZE - 1)]);
+        ring->tail.store(tail, std::memory_order_release);
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    if (log.batch.empty() && dropped == log.reported_dropped)
+        return;
+
+    std::stable_sort(log.batch.begin(), log.batch.end(),
+        [](const LogRecord& left, const LogRecord& right) {
+            return left.time_ns < right.time_ns;
+        });
+
+    log.output.clear();
+    for (const LogRecord& record : log.batch)
+        formatRecord(log.output, record);
+    log.written += log.batch.size();
+
+    if (dropped > log.reported_dropped) {
+        LogRecord record = {};
+        record.time_ns = logNow();
+        record.message = "log records dropped";
+        record.level = LogLevel::warning;
+        record.fields[0] = { "count", static_cast<int64_t>(dropped - log.reported_dropped),
+                             nullptr };
+        record.field_count = 1;
+        formatRecord(log.output, record);
+        log.reported_dropped = dropped;
+    }
+
+    const char* data = log.output.data();
+    size_t size = log.output.size();
+    while (size) {
+        ssize_t count = write(log.fd, data, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+}
+
+void loggerLoop(Logger& log) {
+    std::unique_lock lock(log.mtx);
+    for (;;) {
+        log.condition.wait_for(lock, LOG_FLUSH_PERIOD);
+        drain(log);
+    }
+}
+
+/*!
+ * \brief Кольцо текущего потока.
+ *
+ * Берет свободное кольцо или создает новое. Первое кольцо запускает поток вывода.
+*/
+LogRing* localRing() {
+    if (local_ring.ring)
+        return local_ring.ring;
+
+    Logger& log = logger();
+    std::lock_guard lock(log.mtx);
+    for (auto& ring : log.rings)
+        if (not ring->owned.exchange(true, std::memory_order_acquire))
+            return local_ring.ring = ring.get();
+
+    std::unique_ptr<LogRing> ring(new LogRing());
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    ring->owned = true;
+    local_ring.ring = ring.get();
+    log.rings.push_back(std::move(ring));
+
+    if (not log.started) {
+        log.started = true;
+        std::thread(loggerLoop, std::ref(log)).detach();
+        // Записи, сделанные до exit(), выводятся
+        atexit(logFlush);
+    }
+    return local_ring.ring;
+}
+
+}
+
+/*!
+ * \brief Наименьший выводимый уровень, по умолчанию info.
+*/
+void mega_camera::setLogLevel(LogLevel level) {
+    log_level = level;
+}
+
+/*!
+ * \brief Вывод в файл вместо stderr.
+ *
+ * \param[in] path Путь к файлу, записи дописываются в конец.
+ * \return Статус операции.
+*/
+bool mega_camera::setLogFile(const std::string& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    Logger& log = logger();
+    std::lock_guard lock(log.mtx);
+    drain(log);
+    if (log.fd != STDERR_FILENO)
+        close(log.fd);
+    log.fd = fd;
+    return true;
+}
+
+/*!
+ * \brief Запись сообщения в кольцо текущего потока.
+ *
+ * Не блокируется. Если кольцо заполнено, запись отбрасывается.
+*/
+void mega_camera::logWrite(LogLevel level, const char* message, std::string_view text,
+                           std::initializer_list<LogField> fields) {
+    LogRing* ring = localRing();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRecord& record = ring->records[head & (LOG_RING_SIZE - 1)];
+    record.time_ns = logNow();
+    record.message = message;
+    record.level = level;
+    record.truncated = text.size() > LOG_TEXT_SIZE;
+    record.text_size = static_cast<uint8_t>(std::min(text.size(), LOG_TEXT_SIZE));
+    memcpy(record.text, text.data(), record.text_size);
+    record.field_count = 0;
+    for (const LogField& field : fields) {
+        if (record.field_count == LOG_FIELDS)
+            break;
+        record.fields[record.field_count++] = { field.name, field.value, field.text };
+    }
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/*!
+ * \brief Синхронный вывод всех записей.
+ *
+ * Вызывается перед _exit() и выводом в stdout в обход журнала.
+*/
+void mega_camera::logFlush() {
+    Logger& log = logger();
+    std::lock_guard lock(log.mtx);
+    drain(log);
+}
+
+/*!
+ * \brief Счетчики выведенных и отброшенных записей.
+*/
+LogStats mega_camera::getLogStats() {
+    Logger& log = logger();
+    std::lock_guard lock(log.mtx);
+    LogStats stats = { log.written, 0 };
+    for (const auto& ring : log.rings)
+        stats.dropped += ring->dropped.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,231 @@
+/*!
+ * \brief Воспроизведение записанного трафика.
+ *
+ * Каждое записанное подключение воспроизводится отдельным LedClient в своем потоке,
+ * поэтому одновременность подключений сохраняется. Кадры подключения отправляются
+ * по расписанию записи (в реальном времени или ускоренно в N раз) либо подряд без
+ * пауз. Следующий кадр подключения уходит после ответа на предыдущий или таймаута,
+ * время до ответа и есть задержка запроса.
+*/
+#include <ledctrl/client.h>
+#include "capture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mega_camera;
+
+static const std::string LOCALHOST_IP = "127.0.0.1";
+
+//! Параметры воспроизведения.
+struct ReplayConfig {
+    std::string host = LOCALHOST_IP;
+    uint16_t port = 8014;
+    std::string unix_path = {};
+    bool shared_memory = false;
+    //! Ускорение, 0 - без пауз.
+    double speed = 1.0;
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(1000);
+};
+
+//! Результат одного запроса.
+struct ReplaySample {
+    uint32_t connection;
+    size_t index;
+    double latency_us;
+    bool answered;
+};
+
+/*!
+ * \brief Воспроизведение одного подключения.
+ *
+ * \param[in] config Параметры.
+ * \param[in] connection Номер подключения в записи.
+ * \param[in] frames Кадры подключения.
+ * \param[in] start Начало воспроизведения.
+ * \param[out] samples Результаты запросов.
+*/
+static void replayConnection(const ReplayConfig& config, uint32_t connection,
+                             const std::vector<const CapturedFrame*>& frames,
+                             std::chrono::steady_clock::time_point start,
+                             std::vector<ReplaySample>& samples) {
+    LedClient client;
+    std::mutex reply_mtx;
+    std::condition_variable reply_condition;
+    size_t replies = 0;
+    // Число отправленных запросов. Сервер отвечает по порядку, поэтому N-й ответ
+    // относится к N-му запросу, и опоздавший ответ не засчитывается следующему.
+    size_t requests = 0;
+
+    if (config.speed > 0)
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds(
+            static_cast<int64_t>(static_cast<double>(frames.front()->timestamp_ns) /
+                                 config.speed)));
+
+    SocketStatus status = config.unix_path.empty()
+                          ? client.connectTo(config.host, config.port)
+                          : client.connectUnix(config.unix_path, config.shared_memory);
+    if (status != SocketStatus::connected) {
+        for (size_t i = 0; i < frames.size(); ++i)
+            samples.push_back({ connection, i, 0.0, false });
+        return;
+    }
+
+    client.setHandler(
+        [&](DataBuffer) {
+            std::lock_guard lock(reply_mtx);
+            ++replies;
+            reply_condition.notify_one();
+        }
+    );
+
+    for (size_t i = 0; i < frames.size(); ++i) {
+        const CapturedFrame& frame = *frames[i];
+        if (config.speed > 0)
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(
+                static_cast<int64_t>(static_cast<double>(frame.timestamp_ns) /
+                                     config.speed)));
+
+        auto sent = std::chrono::steady_clock::now();
+        bool answered = client.sendData(std::string(frame.data.begin(), frame.data.end()));
+        if (answered) {
+            size_t sequence = ++requests;
+            std::unique_lock lock(reply_mtx);
+            answered = reply_condition.wait_for(lock, config.timeout,
+                [&replies, sequence]() { return replies >= sequence; });
+        }
+        samples.push_back({
+            connection, i,
+            std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - sent).count(),
+            answered
+        });
+    }
+
+    client.disconnect();
+}
+
+/*!
+ * \brief Значение перцентиля по отсортированной выборке.
+*/
+static double percentile(const std::vector<double>& sorted, double share) {
+    if (sorted.empty())
+        return 0.0;
+    size_t index = static_cast<size_t>(share * static_cast<double>(sorted.size() - 1));
+    return sorted[index];
+}
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [-s speed | -a] [-H host] [-P port]"
+              << " [-x unix_socket [-m]] [-t timeout_ms] [-v] capture" << std::endl
+              << "  -s N     Replay N times faster than recorded (default 1)" << std::endl
+              << "  -a       Replay as fast as possible" << std::endl
+              << "  -v       Print latency of every request" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    ReplayConfig config;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:aH:P:x:mt:v")) != -1) {
+        switch (opt) {
+        case 's':
+            config.speed = std::atof(optarg);
+            break;
+        case 'a':
+            config.speed = 0;
+            break;
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'P':
+            config.port = static_cast<uint16_t>(std::atoi(optarg));
+            break;
+        case 'x':
+            config.unix_path = optarg;
+            break;
+        case 'm':
+            config.shared_memory = true;
+            break;
+        case 't':
+            config.timeout = std::chrono::milliseconds(std::atoi(optarg));
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 || config.speed < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<CapturedFrame> frames;
+    if (not TrafficCapture::load(argv[optind], frames)) {
+        std::cerr << "Unable to read capture " << argv[optind] << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::map<uint32_t, std::vector<const CapturedFrame*>> connections;
+    for (const auto& frame : frames)
+        connections[frame.connection].push_back(&frame);
+
+    std::vector<std::vector<ReplaySample>> results(connections.size());
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    size_t slot = 0;
+
+    for (const auto& [connection, connection_frames] : connections) {
+        threads.emplace_back(replayConnection, std::cref(config), connection,
+                             std::cref(connection_frames), start,
+                             std::ref(results[slot++]));
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start).count();
+    std::vector<double> latencies;
+    size_t lost = 0;
+
+    for (const auto& samples : results) {
+        for (const auto& sample : samples) {
+            if (verbose)
+                std::cout << sample.connection << " " << sample.index << " "
+                          << (sample.answered ? std::to_string(
+                                  static_cast<uint64_t>(sample.latency_us)) : "timeout")
+                          << std::endl;
+            if (sample.answered)
+                latencies.push_back(sample.latency_us);
+            else
+                ++lost;
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "connections: " << connections.size() << std::endl
+              << "requests:    " << frames.size() << " (" << lost
+              << " without reply)" << std::endl
+              << "elapsed:     " << elapsed << " s, "
+              << static_cast<double>(frames.size()) / elapsed << " req/s" << std::endl
+              << "latency us:  p50 " << percentile(latencies, 0.5)
+              << " p90 " << percentile(latencies, 0.9)
+              << " p99 " << percentile(latencies, 0.99)
+              << " max " << (latencies.empty() ? 0.0 : latencies.back()) << std::endl;
+
+    return lost == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,586 @@
+/*!
+ * \brief Репликация состояния на ведомые серверы.
+ *
+ * Ведущий принимает ведомых на отдельном порту и передает им изменения из
+ * server_business пакетами в порядке фиксации. Кадры обычные (длина и данные),
+ * первая строка - заголовок:
+ *
+ *     snapshot <номер> <время> <порт команд> <версия>  - снимок таблицы устройств
+ *     replicate <первый> <последний> <время>           - изменения, по одному в строке
+ *
+ * Номер снимка - номер последнего вошедшего в него изменения, "последний" в пакете -
+ * последний номер изменения ведущего на момент отправки, время - время фиксации
+ * последнего изменения пакета (CLOCK_REALTIME, нс). Пустой пакет раз в
+ * REPLICATION_HEARTBEAT сообщает ведомому, что новых изменений нет.
+ *
+ * Новый ведомый и ведомый, отставший больше чем на REPLICATION_LOG_SIZE изменений,
+ * получают снимок. Ведомый, который не успевает читать, отключается и после
+ * переподключения тоже получает снимок.
+ *
+ * Ведомый отвечает на get-led-* из своей копии, а set-led-* пересылает ведущему на
+ * порт команд и возвращает его ответ. Изменение появляется у ведомого, когда придет
+ * пакет с ним, то есть после ответа.
+*/
+#include "server_base.h"
+#include "led_state.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+using namespace mega_camera;
+
+/*!
+ * \brief Время фиксации изменения, нс.
+*/
+static uint64_t realtimeNs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+namespace {
+
+/*!
+ * \brief Ведомый у ведущего.
+ *
+ * Сокет неблокирующий: кадры копятся в output и отправляются, пока сокет принимает.
+ * Новый пакет собирается, только когда предыдущий отправлен целиком.
+*/
+struct Follower {
+    Socket socket;
+    //! Номер следующего изменения для ведомого.
+    uint64_t next;
+    //! Неотправленные кадры, с позиции output_sent.
+    std::string output;
+    size_t output_sent;
+    //! Время последней отправки или постановки кадра в пустой output.
+    std::chrono::steady_clock::time_point progress;
+};
+
+/*!
+ * \brief Постановка кадра в очередь ведомого.
+*/
+void queueReplicationFrame(Follower& follower, const std::string& payload) {
+    uint32_t size = static_cast<uint32_t>(payload.size());
+
+    if (follower.output.empty())
+        follower.progress = std::chrono::steady_clock::now();
+    follower.output.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    follower.output += payload;
+}
+
+/*!
+ * \brief Отправка очереди ведомого без ожидания.
+ *
+ * \return false, если соединение с ведомым нарушено.
+*/
+bool flushReplication(Follower& follower) {
+    while (follower.output_sent < follower.output.size()) {
+        ssize_t answ = send(follower.socket, follower.output.data() + follower.output_sent,
+                            follower.output.size() - follower.output_sent,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (answ < 0 && errno == EINTR)
+            continue;
+        if (answ < 0 && errno == EAGAIN)
+            return true;
+        if (answ <= 0)
+            return false;
+        follower.output_sent += static_cast<size_t>(answ);
+        follower.progress = std::chrono::steady_clock::now();
+    }
+    follower.output.clear();
+    follower.output_sent = 0;
+    return true;
+}
+
+}
+
+ReplicationLog::ReplicationLog()
+    : mtx()
+    , append_condition()
+    , records()
+    , last_seq(0)
+    , enabled(false)
+{}
+
+void ReplicationLog::enable() {
+    std::lock_guard lock(mtx);
+    enabled = true;
+}
+
+/*!
+ * \brief Выключение журнала, ожидающие в wait() освобождаются.
+*/
+void ReplicationLog::disable() {
+    {
+        std::lock_guard lock(mtx);
+        enabled = false;
+        records.clear();
+    }
+    append_condition.notify_all();
+}
+
+/*!
+ * \brief Добавление изменения.
+ *
+ * Вызывается под тем же мьютексом, что и само изменение, поэтому номера идут в
+ * порядке фиксации.
+ *
+ * \param[in] command Каноническая команда.
+ * \return Номер изменения, 0 - журнал выключен.
+*/
+uint64_t ReplicationLog::append(const std::string& command) {
+    uint64_t seq;
+    {
+        std::lock_guard lock(mtx);
+        if (not enabled)
+            return 0;
+        seq = ++last_seq;
+        records.push_back({ seq, realtimeNs(), command });
+        if (records.size() > REPLICATION_LOG_SIZE)
+            records.pop_front();
+    }
+    append_condition.notify_all();
+    return seq;
+}
+
+uint64_t ReplicationLog::lastSeq() {
+    std::lock_guard lock(mtx);
+    return last_seq;
+}
+
+/*!
+ * \brief Чтение изменений, начиная с номера.
+ *
+ * \param[in] from Номер первого изменения.
+ * \param[in] max_count Наибольшее число изменений.
+ * \param[out] records_out Изменения.
+ * \return false, если изменение from уже вытеснено из журнала.
+*/
+bool ReplicationLog::read(uint64_t from, size_t max_count,
+                          std::vector<ReplicationRecord>& records_out) {
+    std::lock_guard lock(mtx);
+    if (from > last_seq)
+        return true;
+    if (records.empty() || from < records.front().seq)
+        return false;
+
+    size_t first = static_cast<size_t>(from - records.front().seq);
+    size_t count = std::min(max_count, records.size() - first);
+    for (size_t i = first; i < first + count; ++i)
+        records_out.push_back(records[i]);
+    return true;
+}
+
+/*!
+ * \brief Ожидание изменения с номером seq.
+*/
+void ReplicationLog::wait(uint64_t seq, std::chrono::milliseconds timeout) {
+    std::unique_lock lock(mtx);
+    append_condition.wait_for(lock, timeout,
+        [this, seq]() {
+            return last_seq >= seq || not enabled;
+        }
+    );
+}
+
+/*!
+ * \brief Включение режима ведущего.
+ *
+ * Ведомые подключаются к replication_port. Поток раздачи запускается сразу.
+ *
+ * \param[in] replication_port Порт для ведомых.
+ * \return Состояние сокета.
+*/
+SocketStatus LedServer::enableReplication(const uint16_t replication_port) {
+    int flag{true};
+    SocketAddr_in address;
+
+    if (replicating || replication_thread.joinable())
+        return SocketStatus::err_socket_bind;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(replication_port);
+    address.sin_family = AF_INET;
+
+    Socket sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return SocketStatus::err_socket_init;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) == -1 ||
+            bind(sock, reinterpret_cast<struct sockaddr*>(&address),
+                 sizeof(address)) < 0) {
+        close(sock);
+        return SocketStatus::err_socket_bind;
+    }
+    if (listen(sock, SOMAXCONN) < 0) {
+        close(sock);
+        return SocketStatus::err_socket_listening;
+    }
+
+    startReplication(sock);
+    return SocketStatus::up;
+}
+
+/*!
+ * \brief Запуск раздачи изменений на слушающем сокете.
+ *
+ * \param[in] sock Неблокирующий слушающий сокет, свой или от предшественника.
+*/
+void LedServer::startReplication(Socket sock) {
+    replication_socket = sock;
+    replicationLog().enable();
+    replicating = true;
+    replication_thread = std::thread(&LedServer::replicationLoop, this);
+}
+
+/*!
+ * \brief Поток раздачи изменений ведомым.
+ *
+ * Ждет новых изменений не дольше REPLICATION_HEARTBEAT, затем принимает новых
+ * ведомых и отправляет каждому все накопившиеся изменения. Пока поток отправляет,
+ * изменения копятся, поэтому под нагрузкой пакеты растут сами.
+ *
+ * Отправка не блокируется: пока у ведомого есть неотправленный пакет, поток
+ * повторяет отправку раз в REPLICATION_SEND_RETRY и не задерживает остальных.
+ * Ведомый, который не принял ни байта за REPLICATION_TIMEOUT, отключается.
+*/
+void LedServer::replicationLoop() {
+    std::vector<Follower> followers;
+    std::vector<ReplicationRecord> records;
+    ReplicationLog& log = replicationLog();
+    auto last_heartbeat = std::chrono::steady_clock::now();
+
+    auto queueSnapshot = [this](Follower& follower) {
+        uint64_t seq;
+        std::string state = replicationSnapshot(seq);
+        follower.next = seq + 1;
+        queueReplicationFrame(follower,
+            "snapshot " + std::to_string(seq) + " " + std::to_string(realtimeNs()) + " " +
+            std::to_string(static_cast<unsigned>(port)) + " " +
+            std::to_string(static_cast<unsigned>(LED_STATE_VERSION)) + "\n" + state);
+    };
+
+    while (replicating) {
+        uint64_t next = UINT64_MAX;
+        bool blocked = false;
+        for (const auto& follower : followers) {
+            if (follower.output.empty())
+                next = std::min(next, follower.next);
+            else
+                blocked = true;
+        }
+        log.wait(next, blocked ? REPLICATION_SEND_RETRY : REPLICATION_HEARTBEAT);
+        if (not replicating)
+            break;
+
+        Socket peer;
+        while ((peer = accept4(replication_socket, nullptr, nullptr,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            int flag{1};
+            setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            followers.push_back({ peer, 0, std::string(), 0, std::chrono::steady_clock::now() });
+            queueSnapshot(followers.back());
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        bool heartbeat = now - last_heartbeat >= REPLICATION_HEARTBEAT;
+        if (heartbeat)
+            last_heartbeat = now;
+
+        uint64_t last = log.lastSeq();
+        for (auto it = followers.begin(); it != followers.end();) {
+            Follower& follower = *it;
+            bool sent = flushReplication(follower);
+            while (sent && follower.output.empty() && follower.next <= last) {
+                records.clear();
+                if (not log.read(follower.next, REPLICATION_BATCH, records)) {
+                    queueSnapshot(follower);
+                } else {
+                    if (records.empty())
+                        break;
+                    std::string payload = "replicate " + std::to_string(follower.next) + " " +
+                                          std::to_string(last) + " " +
+                                          std::to_string(records.back().time_ns) + "\n";
+                    for (const auto& record : records)
+                        payload += record.command + "\n";
+                    queueReplicationFrame(follower, payload);
+                    follower.next = records.back().seq + 1;
+                }
+                sent = flushReplication(follower);
+            }
+            if (sent && heartbeat && follower.output.empty() && follower.next > last) {
+                queueReplicationFrame(follower,
+                    "replicate " + std::to_string(follower.next) + " " +
+                    std::to_string(last) + " 0\n");
+                sent = flushReplication(follower);
+            }
+
+            if (sent && not follower.output.empty() &&
+                    std::chrono::steady_clock::now() - follower.progress >= REPLICATION_TIMEOUT)
+                sent = false;
+            if (sent) {
+                ++it;
+            } else {
+                close(follower.socket);
+                it = followers.erase(it);
+            }
+        }
+        replication_followers = static_cast<uint32_t>(followers.size());
+    }
+
+    for (const auto& follower : followers)
+        close(follower.socket);
+    replication_followers = 0;
+}
+
+/*!
+ * \brief Включение режима ведомого.
+ *
+ * Поток приема подключается к ведущему, применяет снимок и пакеты изменений и
+ * переподключается при обрыве или молчании ведущего дольше REPLICATION_TIMEOUT.
+ *
+ * \param[in] host Адрес ведущего.
+ * \param[in] replication_port Порт ведущего для ведомых.
+ * \return Состояние.
+*/
+SocketStatus LedServer::followPrimary(const std::string& host,
+                                      const uint16_t replication_port) {
+    if (replicating || replication_thread.joinable())
+        return SocketStatus::err_socket_connect;
+
+    primary_host = host;
+    primary_port = replication_port;
+    replicating = true;
+    replication_thread = std::thread(&LedServer::followLoop, this);
+    return SocketStatus::up;
+}
+
+/*!
+ * \brief Поток приема изменений от ведущего.
+*/
+void LedServer::followLoop() {
+    while (replicating) {
+        std::atomic<bool> broken = false;
+        std::atomic<int64_t> received = std::chrono::steady_clock::now()
+                                        .time_since_epoch().count();
+        LedClient stream;
+
+        if (stream.connectTo(primary_host, primary_port) == SocketStatus::connected) {
+            stream.setHandler(
+                [this, &broken, &received](DataBuffer frame) {
+                    received = std::chrono::steady_clock::now().time_since_epoch().count();
+                    // Разрыв в номерах или чужая версия: нужен новый снимок
+                    if (not applyReplicationFrame(frame)) {
+                        broken = true;
+                        replication_condition.notify_all();
+                    }
+                }
+            );
+        }
+
+        std::unique_lock lock(replication_mtx);
+        while (replicating && not broken && stream.getStatus() == SocketStatus::connected &&
+                std::chrono::steady_clock::now().time_since_epoch().count() - received <
+                std::chrono::steady_clock::duration(REPLICATION_TIMEOUT).count())
+            replication_condition.wait_for(lock, REPLICATION_HEARTBEAT);
+        lock.unlock();
+
+        replica_connected = false;
+        bool connected = stream.getStatus() == SocketStatus::connected;
+        stream.disconnect();
+
+        lock.lock();
+        if (replicating && not connected)
+            replication_condition.wait_for(lock, REPLICATION_RETRY);
+    }
+}
+
+/*!
+ * \brief Применение кадра от ведущего. Вызывается потоком приема.
+ *
+ * \return false, если поток изменений нарушен и нужен новый снимок.
+*/
+bool LedServer::applyReplicationFrame(const DataBuffer& frame) {
+    const char* text = reinterpret_cast<const char*>(frame.data());
+    const char* end = text + frame.size();
+    const char* eol = std::find(text, end, '\n');
+    if (eol == end)
+        return false;
+
+    std::string header(text, eol);
+    uint64_t seq, last, time_ns;
+    unsigned command_port, version;
+
+    if (sscanf(header.c_str(), "snapshot %" SCNu64 " %" SCNu64 " %u %u",
+               &seq, &time_ns, &command_port, &version) == 4) {
+        if (version != LED_STATE_VERSION || command_port > UINT16_MAX ||
+                not importState(DataBuffer(eol + 1, end)))
+            return false;
+        primary_command_port = static_cast<uint16_t>(command_port);
+        replica_applied = seq;
+        replica_primary = seq;
+        ++replica_snapshots;
+        replica_connected = true;
+        return true;
+    }
+
+    if (sscanf(header.c_str(), "replicate %" SCNu64 " %" SCNu64 " %" SCNu64,
+               &seq, &last, &time_ns) != 3 || not replica_connected ||
+            seq != replica_applied + 1)
+        return false;
+
+    for (const char* line = eol + 1; line < end;) {
+        const char* next = std::find(line, end, '\n');
+        // Команда, которую ведомый не смог применить: копия разошлась с ведущим
+        if (not applyReplicated(std::string(line, next)))
+            return false;
+        replica_applied = seq++;
+        line = next + (next != end);
+    }
+    replica_primary = last;
+    if (time_ns) {
+        uint64_t now = realtimeNs();
+        replica_lag_us = now > time_ns ? (now - time_ns) / 1000 : 0;
+    }
+    ++replica_batches;
+    return true;
+}
+
+/*!
+ * \brief Пересылка изменяющей команды ведущему.
+ *
+ * Ответы ведущего приходят в порядке команд, поэтому ожидающие стоят в очереди.
+ * Ожидающий, не дождавшийся ответа за REPLICATION_TIMEOUT, остается в очереди до
+ * ответа, чтобы не сдвинуть ответы следующим.
+ *
+ * \param[in] command Команда клиента.
+ * \return Ответ ведущего.
+*/
+std::string LedServer::forwardCommand(const std::string& command) {
+    auto reply = std::make_shared<std::promise<DataBuffer>>();
+    std::future<DataBuffer> answer = reply->get_future();
+    std::unique_ptr<LedClient> stale;
+    {
+        std::lock_guard lock(forward_mtx);
+        if (not primary_client || primary_client->getStatus() != SocketStatus::connected) {
+            // Старое подключение закрывается вне forward_mtx: его поток ждет мьютекс
+            stale = std::move(primary_client);
+            forward_pending.clear();
+            if (primary_command_port == 0)
+                return "FAILED\n";
+            primary_client.reset(new LedClient());
+            if (primary_client->connectTo(primary_host, primary_command_port) !=
+                    SocketStatus::connected) {
+                primary_client.reset();
+                return "FAILED\n";
+            }
+            LedClient* client = primary_client.get();
+            primary_client->setHandler(
+                [this, client](DataBuffer data) {
+                    std::lock_guard handler_lock(forward_mtx);
+                    if (primary_client.get() != client || forward_pending.empty())
+                        return;
+                    forward_pending.front()->set_value(std::move(data));
+                    forward_pending.pop_front();
+                }
+            );
+        }
+        forward_pending.push_back(reply);
+        if (not primary_client->sendData(command)) {
+            forward_pending.pop_back();
+            return "FAILED\n";
+        }
+    }
+
+    ++replica_forwarded;
+    try {
+        if (answer.wait_for(REPLICATION_TIMEOUT) != std::future_status::ready)
+            return "FAILED\n";
+        DataBuffer data = answer.get();
+        return std::string(data.begin(), data.end());
+    } catch (std::future_error&) {
+        return "FAILED\n";
+    }
+}
+
+/*!
+ * \brief Команды репликации.
+ *
+ * get-replication возвращает роль и отставание, у ведомого set-* пересылаются
+ * ведущему. Вызывается под access_mtx клиента.
+ *
+ * \return false, если команда обрабатывается обычным путем.
+*/
+bool LedServer::replicationBusiness(const std::string& input, Client& client) {
+    if (input.compare(0, input.find_first_of(" \n"), "get-replication") == 0) {
+        ReplicationStats stats = getReplicationStats();
+        const char* role = not primary_host.empty() ? "follower"
+                           : replication_socket != -1 ? "primary" : "standalone";
+        char reply[256];
+        snprintf(reply, sizeof(reply),
+                 "OK %s followers=%" PRIu32 " applied=%" PRIu64 " primary=%" PRIu64
+                 " lag=%" PRIu64 " lag_us=%" PRIu64 "\n",
+                 role, stats.followers, stats.applied, stats.primary,
+                 stats.primary - stats.applied, stats.lag_us);
+        client.sendData(reply);
+        return true;
+    }
+
+    if (primary_host.empty() || input.compare(0, 4, "set-") != 0)
+        return false;
+    // Неизвестная команда отклоняется здесь: ответы ведущего идут строго по порядку
+    if (not isCommand(input)) {
+        client.sendData("FAILED\n");
+        return true;
+    }
+    client.sendData(forwardCommand(input));
+    return true;
+}
+
+/*!
+ * \brief Состояние репликации.
+ *
+ * У ведущего applied и primary - номер его последнего изменения.
+*/
+ReplicationStats LedServer::getReplicationStats() const {
+    if (primary_host.empty()) {
+        uint64_t last = replicationLog().lastSeq();
+        return { replication_followers, false, last, last, 0, 0, 0, 0 };
+    }
+    uint64_t applied = replica_applied;
+    return {
+        0, replica_connected, applied, std::max<uint64_t>(replica_primary, applied),
+        replica_lag_us, replica_batches, replica_snapshots, replica_forwarded
+    };
+}
+
+/*!
+ * \brief Остановка репликации в любой роли.
+*/
+void LedServer::stopReplication() {
+    std::unique_ptr<LedClient> client;
+
+    {
+        std::lock_guard lock(replication_mtx);
+        replicating = false;
+    }
+    replication_condition.notify_all();
+    if (replication_socket != -1)
+        replicationLog().disable();
+    if (replication_thread.joinable())
+        replication_thread.join();
+    if (replication_socket != -1) {
+        close(replication_socket);
+        replication_socket = -1;
+    }
+
+    {
+        std::lock_guard lock(forward_mtx);
+        client = std::move(primary_client);
+        forward_pending.clear();
+    }
+    replica_connected = false;
+}
@@ -2,9 +2,18 @@
  * \brief Тест сервера.
 */
 #include "server_base.h"
+#include "effects.h"
+#include "logger.h"
 
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <signal.h>
+#include <unistd.h>
 
 using namespace mega_camera;
 
@@ -25,37 +34,292 @@ using namespace mega_camera;
     std::thread::hardware_concurrency()
 );*/
 
-LedServer server(8014);
+static std::unique_ptr<LedServer> server;
+
+//! Запрошена остановка. Атомарная переменная без блокировок - единственное, что
+//! обработчик сигнала может безопасно изменить.
+static std::atomic<bool> stop_requested = false;
+static_assert(std::atomic<bool>::is_always_lock_free);
 
 static void intHandler(int dummy) {
-    server.stop();
+    stop_requested = true;
+}
+
+static void usage(const char* name) {
+    std::cout << "Usage: " << name << " [-P port] [-s state_file] [-j journal]"
+              << " [-c cpus] [-i cpus] [-n node] [-l] [-a min:max] [-e hz] [-w capture]"
+              << " [-T trace] [-b bytes] [-x unix_socket]"
+              << " [-p udp_port] [-R port | -F host:port] [-L log] [-v]"
+              << " [-u upgrade_socket [-t]]"
+              << std::endl
+              << "  -P port  TCP port for commands (default 8014)" << std::endl
+              << "  -s path  Memory-mapped LED state file" << std::endl
+              << "  -j path  Write-ahead journal of set-led-* commands" << std::endl
+              << "  -c cpus  Pin handler workers to CPUs, e.g. 0-3,8" << std::endl
+              << "  -i cpus  Run accept/data loops on separate CPUs" << std::endl
+              << "  -n node  Pin handler workers to CPUs of a NUMA node" << std::endl
+              << "  -l       Node-local memory for pinned threads" << std::endl
+              << "  -a min:max Resize handler pool by queue wait time" << std::endl
+              << "  -e hz    Effects tick rate, 0 disables effects" << std::endl
+              << "  -w path  Record incoming frames for the replay tool" << std::endl
+              << "  -T path  Trace requests, trace-dump writes spans to path" << std::endl
+              << "  -b bytes Unacknowledged stream-data window per connection" << std::endl
+              << "  -x path  Unix socket for local clients" << std::endl
+              << "  -p port  UDP port for sequence-numbered set-led-* updates" << std::endl
+              << "  -R port  Primary: stream state changes to followers on port" << std::endl
+              << "  -F host:port Follower: replicate from primary, forward set-led-*"
+              << std::endl
+              << "  -L path  Append log to path instead of stderr" << std::endl
+              << "  -v       Log every command" << std::endl
+              << "  -u path  Unix socket for hot upgrade" << std::endl
+              << "  -t       Take over sockets from the process on -u path" << std::endl;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    std::string upgrade_path;
+    std::string state_path;
+    std::string journal_path;
+    std::string unix_path;
+    std::string capture_path;
+    std::string trace_path;
+    std::string log_path;
+    PlacementConfig placement;
+    int udp_port = -1;
+    int command_port = 8014;
+    int replication_port = -1;
+    std::string primary_host;
+    int primary_port = -1;
+    int tick_rate = EFFECTS_TICK_RATE;
+    long stream_window = -1;
+    uint pool_min = 0;
+    uint pool_max = 0;
+    uint thread_count = std::thread::hardware_concurrency();
+    bool take_over = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "P:s:j:c:i:n:la:e:w:T:b:x:p:R:F:L:vu:th")) != -1) {
+        switch (opt) {
+        case 'c':
+            placement.worker_cpus = parseCpuList(optarg);
+            if (placement.worker_cpus.empty()) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            placement.io_cpus = parseCpuList(optarg);
+            if (placement.io_cpus.empty()) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n': {
+            char* end;
+            long node = std::strtol(optarg, &end, 10);
+            // Узел без процессоров привязал бы обработчики к пустому множеству
+            if (end == optarg || *end || node < 0 || node > INT_MAX ||
+                    nodeCpuList(static_cast<int>(node)).empty()) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            placement.numa_node = static_cast<int>(node);
+            break;
+        }
+        case 'l':
+            placement.numa_local = true;
+            break;
+        case 'a':
+            if (sscanf(optarg, "%u:%u", &pool_min, &pool_max) != 2 ||
+                    pool_max == 0 || pool_min > pool_max) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            state_path = optarg;
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        case 'e':
+            tick_rate = std::atoi(optarg);
+            break;
+        case 'w':
+            capture_path = optarg;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'b':
+            stream_window = std::atol(optarg);
+            break;
+        case 'x':
+            unix_path = optarg;
+            break;
+        case 'p':
+            udp_port = std::atoi(optarg);
+            break;
+        case 'P':
+            command_port = std::atoi(optarg);
+            break;
+        case 'R':
+            replication_port = std::atoi(optarg);
+            break;
+        case 'F': {
+            std::string address = optarg;
+            size_t colon = address.rfind(':');
+            if (colon == std::string::npos) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            primary_host = address.substr(0, colon);
+            primary_port = std::atoi(address.c_str() + colon + 1);
+            break;
+        }
+        case 'L':
+            log_path = optarg;
+            break;
+        case 'v':
+            setLogLevel(LogLevel::debug);
+            break;
+        case 'u':
+            upgrade_path = optarg;
+            break;
+        case 't':
+            take_over = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((take_over && upgrade_path.empty()) || udp_port > UINT16_MAX || tick_rate < 0 ||
+            command_port <= 0 || command_port > UINT16_MAX ||
+            replication_port > UINT16_MAX || primary_port > UINT16_MAX ||
+            (not primary_host.empty() && primary_port <= 0) ||
+            (replication_port >= 0 && not primary_host.empty())) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (not placement.worker_cpus.empty())
+        thread_count = static_cast<uint>(placement.worker_cpus.size());
+    else if (placement.numa_node >= 0)
+        thread_count = static_cast<uint>(nodeCpuList(placement.numa_node).size());
+
+    if (not log_path.empty() && not setLogFile(log_path)) {
+        logError("Unable to open log", log_path);
+        return EXIT_FAILURE;
+    }
+
+    server.reset(new LedServer(static_cast<uint16_t>(command_port), {}, nullptr,
+                               [](LedServer::Client&) noexcept {},
+                               [](LedServer::Client&) noexcept {},
+                               thread_count, placement));
+
+    if (not state_path.empty() &&
+            not server->openState(state_path, std::chrono::milliseconds(1000))) {
+        logError("Unable to open state file", state_path);
+        return EXIT_FAILURE;
+    }
+
+    // При передаче журнал открывается в takeover(), после остановки предшественника
+    if (not take_over && not journal_path.empty() &&
+            not server->openJournal(journal_path)) {
+        logError("Unable to open journal", journal_path);
+        return EXIT_FAILURE;
+    }
+
+    if (pool_max > 0)
+        server->setPoolBounds(pool_min, pool_max);
+
+    if (stream_window > 0)
+        server->setStreamWindow(static_cast<size_t>(stream_window));
+
+    if (tick_rate > 0 && not server->startEffects(static_cast<uint>(tick_rate))) {
+        logError("Unable to start effects");
+        return EXIT_FAILURE;
+    }
+
+    if (not capture_path.empty() && not server->startCapture(capture_path)) {
+        logError("Unable to open capture file", capture_path);
+        return EXIT_FAILURE;
+    }
+
+    if (not trace_path.empty() && not server->setTracing(trace_path, true)) {
+        logError("Built without LEDCTRL_TRACING");
+        return EXIT_FAILURE;
+    }
+
+    if (not take_over && not unix_path.empty() &&
+            server->listenUnix(unix_path) != SocketStatus::up) {
+        logError("Unable to listen on", unix_path);
+        return EXIT_FAILURE;
+    }
+
+    // При передаче UDP сокет приходит от предшественника
+    if (not take_over && udp_port >= 0 &&
+            server->enableUdp(static_cast<uint16_t>(udp_port)) != SocketStatus::up) {
+        logError("Unable to bind UDP port", {}, { { "port", udp_port } });
+        return EXIT_FAILURE;
+    }
+
+    // При передаче сокет для ведомых приходит от предшественника
+    if (not take_over && replication_port >= 0 &&
+            server->enableReplication(static_cast<uint16_t>(replication_port)) !=
+            SocketStatus::up) {
+        logError("Unable to listen for followers", {}, { { "port", replication_port } });
+        return EXIT_FAILURE;
+    }
+
+    if (not primary_host.empty())
+        server->followPrimary(primary_host, static_cast<uint16_t>(primary_port));
+
     struct sigaction act;
     act.sa_handler = &intHandler;
     sigfillset(&act.sa_mask);
     act.sa_flags = 0;
 
     if (sigaction(SIGINT, &act, NULL) == -1) {
-        std::cout << "Error: Unable to handle SIGINT" <<
-                  std::endl;
+        logError("Unable to handle SIGINT");
         return EXIT_FAILURE;
     }
 
     try {
-        if (server.start() == SocketStatus::up) {
-            server.joinLoop();
-            std::cout << std::endl << "Server stopped" <<
-                      std::endl;
+        SocketStatus status = take_over ? server->takeover(upgrade_path, journal_path)
+                              : server->start();
+        if (status == SocketStatus::up) {
+            if (not upgrade_path.empty() &&
+                    server->enableUpgrade(upgrade_path) != SocketStatus::up)
+                logWarning("Hot upgrade socket isn't available", upgrade_path);
+            // stop() берет блокировки и ждет потоки, поэтому вызывается здесь, а не в
+            // обработчике сигнала. Сервер останавливается и сам, после передачи преемнику.
+            while (not stop_requested && server->getStatus() == SocketStatus::up)
+                std::this_thread::sleep_for(std::chrono::milliseconds(LOOP_POLL_TIMEOUT));
+            if (stop_requested && server->getStatus() == SocketStatus::up)
+                server->stop();
+            server->joinLoop();
+            logInfo("Server stopped");
+            if (pool_max > 0) {
+                PoolStats stats = server->getPoolStats();
+                logInfo("Pool threads", {}, {
+                    { "peak", stats.peak },
+                    { "grown", static_cast<int64_t>(stats.grown) },
+                    { "shrunk", static_cast<int64_t>(stats.shrunk) }
+                });
+            }
+            // Отчет идет в stdout после записей журнала
+            logFlush();
+            std::cout << lockProfileReport() << std::flush;
             _exit(EXIT_SUCCESS);
         } else {
-            std::cout << "Server start error! Error code:"
-                      << int(server.getStatus()) << std::endl;
+            logError("Server start error", {},
+                     { { "status", int(server->getStatus()) } });
             return EXIT_FAILURE;
         }
     } catch (std::exception& except) {
-        std::cerr << except.what();
+        logError("Server error", except.what());
         return EXIT_FAILURE;
     }
 }
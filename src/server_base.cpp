@@ -2,14 +2,30 @@
  * \brief Реализация сервера.
 */
 #include "server_base.h"
+#include "shm_channel.h"
+#include "fd_passing.h"
+#include "trace.h"
+#include "logger.h"
+
+#include <arpa/inet.h>
 
-#include <iostream>
 #include <chrono>
 #include <cstring>
 #include <mutex>
 
 using namespace mega_camera;
 
+/*!
+ * \brief Адрес клиента для журнала.
+*/
+static std::string clientAddress(const SocketAddr_in& address, bool unix_domain) {
+    if (unix_domain)
+        return "unix";
+    char host[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+    return std::string(host) + ":" + std::to_string(static_cast<unsigned>(ntohs(address.sin_port)));
+}
+
 /*!
  * \brief Запуск сервера.
  *
@@ -45,13 +61,26 @@ SocketStatus LedServer::start() {
 
     print_screen();
     _status = SocketStatus::up;
-
-    thread_pool.addJob([this] {handlingAcceptLoop();});
-    thread_pool.addJob([this] {waitingDataLoop();});
+    startLoops();
 
     return _status;
 }
 
+/*!
+ * \brief Запуск циклов приема соединений и данных.
+*/
+void LedServer::startLoops() {
+    loopPool().addJob([this] {handlingAcceptLoop();});
+    loopPool().addJob([this] {waitingDataLoop();});
+}
+
+/*!
+ * \brief Пул, в котором выполняются циклы приема.
+*/
+ThreadPool& LedServer::loopPool() {
+    return io_pool ? *io_pool : thread_pool;
+}
+
 /*!
  * \brief Остановка сервера.
  *
@@ -62,12 +91,104 @@ SocketStatus LedServer::start() {
 */
 void LedServer::stop() {
     _status = SocketStatus::close;
-    shutdown(serv_socket, SD_BOTH);
-    close(serv_socket);
-    for (auto& cl : client_list)
-        cl->disconnect();
+    {
+        // Задания отключения удаляют клиентов из списка в пуле обработчиков
+        std::lock_guard lock(client_mutex);
+        if (handed_over) {
+            // Сокеты принадлежат преемнику: только закрываем дескрипторы
+            close(serv_socket);
+            for (auto& cl : client_list)
+                if (cl) cl->detach();
+        } else {
+            shutdown(serv_socket, SD_BOTH);
+            close(serv_socket);
+            for (auto& cl : client_list)
+                if (cl) cl->disconnect();
+        }
+    }
+    if (unix_socket != -1) {
+        close(unix_socket);
+        if (not handed_over)
+            unlink(unix_path.c_str());
+        unix_socket = -1;
+    }
+    if (udp_socket != -1) {
+        close(udp_socket);
+        udp_socket = -1;
+    }
+    if (upgrade_socket != -1) {
+        shutdown(upgrade_socket, SD_BOTH);
+        close(upgrade_socket);
+        upgrade_socket = -1;
+    }
+    if (io_pool)
+        io_pool->dropUnstartedJobs();
     thread_pool.dropUnstartedJobs();
-    client_list.clear();
+    {
+        std::lock_guard lock(client_mutex);
+        client_list.clear();
+    }
+    stopReplication();
+    stopCapture();
+    stopEffects();
+    syncState();
+}
+
+/*!
+ * \brief Установка емкости очереди класса приоритета.
+ *
+ * \param[in] priority Класс приоритета.
+ * \param[in] capacity Емкость, 0 - без ограничения.
+*/
+void LedServer::setQueueCapacity(JobPriority priority, size_t capacity) {
+    thread_pool.setLaneCapacity(priority, capacity);
+}
+
+/*!
+ * \brief Состояние очереди класса приоритета.
+*/
+LaneStats LedServer::getQueueStats(JobPriority priority) {
+    return thread_pool.getLaneStats(priority);
+}
+
+/*!
+ * \brief Адаптивный размер пула обработчиков.
+ *
+ * Пул добавляет потоки, когда сообщения ждут в очереди дольше POOL_WAIT_TARGET, и
+ * завершает простаивающие потоки после POOL_IDLE_COOLDOWN.
+ *
+ * \param[in] min_threads Нижняя граница.
+ * \param[in] max_threads Верхняя граница, 0 - фиксированный размер.
+*/
+void LedServer::setPoolBounds(uint min_threads, uint max_threads) {
+    thread_pool.setAdaptive(min_threads, max_threads);
+}
+
+/*!
+ * \brief Размер пула обработчиков и счетчики его изменения.
+*/
+PoolStats LedServer::getPoolStats() {
+    return thread_pool.getPoolStats();
+}
+
+/*!
+ * \brief Запуск записи входящих кадров.
+ *
+ * Каждый кадр пишется с меткой времени и номером подключения, файл
+ * воспроизводится утилитой replay.
+ *
+ * \param[in] path Путь к файлу записи.
+ * \return Статус операции.
+*/
+bool LedServer::startCapture(const std::string& path) {
+    return capture.open(path);
+}
+
+/*!
+ * \brief Остановка записи трафика.
+*/
+void LedServer::stopCapture() {
+    capture.close();
 }
 
 /*!
@@ -78,85 +199,304 @@ void LedServer::joinLoop() {
 }
 
 /*!
- * \brief Задание на прием новых соединений.
+ * \brief Таймаут poll для циклов приема.
+ *
+ * Пока в общем пуле есть обработчики сообщений, циклы не ждут в poll, чтобы не
+ * занимать поток. В отдельном пуле циклы ждут всегда.
 */
-void LedServer::handlingAcceptLoop() {
-    SockLen_t addrlen = sizeof(SocketAddr_in);
-    SocketAddr_in client_addr;
+int LedServer::loopPollTimeout() {
+    if (io_pool)
+        return LOOP_POLL_TIMEOUT;
+    return thread_pool.hasPendingWork() ? 0 : LOOP_POLL_TIMEOUT;
+}
 
-    //! Прием нового подключения в блокирующем режиме.
-    Socket client_socket = accept4(
-        serv_socket, reinterpret_cast<struct sockaddr*>(&client_addr), &addrlen, 0);
-
-    if (client_socket >= 0 && _status == SocketStatus::up) {
-        if (enableKeepAlive(client_socket)) {
-            std::unique_ptr<Client> client(new Client(
-                                               client_socket, client_addr));
-            connect_hndl(*client);
-            client_mutex.lock();
-            client_list.emplace_back(std::move(client));
-            client_mutex.unlock();
-        } else {
-            shutdown(client_socket, 0);
-            close(client_socket);
+/*!
+ * \brief Задание на прием новых соединений и датаграмм.
+ *
+ * Задание удерживает loop_mtx в разделяемом режиме. Если блокировка недоступна,
+ * значит идет передача сокетов преемнику и задание не перезапускается. UDP сокет
+ * опрашивается вместе со слушающими, чтобы циклов приема было ровно IO_THREAD_COUNT.
+*/
+void LedServer::handlingAcceptLoop() {
+    {
+        std::shared_lock loop_lock(loop_mtx, std::try_to_lock);
+        if (not loop_lock.owns_lock() || handing_off)
+            return;
+
+        pollfd fds[3] = {
+            { serv_socket, POLLIN, 0 }, { unix_socket, POLLIN, 0 }, { udp_socket, POLLIN, 0 }
+        };
+        // poll пропускает элементы с отрицательным дескриптором
+        if (poll(fds, 3, loopPollTimeout()) > 0) {
+            if (fds[0].revents & POLLIN)
+                acceptClient(serv_socket, false);
+            if (fds[1].revents & POLLIN)
+                acceptClient(unix_socket, true);
+            if (fds[2].revents & POLLIN)
+                receiveDatagrams();
         }
     }
 
-    if (_status == SocketStatus::up)
-        thread_pool.addJob([this]() {
+    if (_status == SocketStatus::up && not handing_off)
+        loopPool().addJob([this]() {
         handlingAcceptLoop();
     });
 }
 
+/*!
+ * \brief Прием одного подключения.
+ *
+ * \param[in] listener Слушающий сокет.
+ * \param[in] unix_domain Сокет AF_UNIX, keep alive не настраивается.
+*/
+void LedServer::acceptClient(Socket listener, bool unix_domain) {
+    SockLen_t addrlen = sizeof(SocketAddr_in);
+    SocketAddr_in client_addr;
+
+    memset(&client_addr, 0, sizeof(client_addr));
+    //! Адрес unix клиента не нужен.
+    Socket client_socket = unix_domain
+        ? accept4(listener, nullptr, nullptr, 0)
+        : accept4(listener, reinterpret_cast<struct sockaddr*>(&client_addr), &addrlen, 0);
+
+    if (client_socket < 0 || _status != SocketStatus::up)
+        return;
+
+    if (unix_domain || enableKeepAlive(client_socket)) {
+        std::unique_ptr<Client> client(new Client(
+                                           client_socket, client_addr, thread_pool));
+        client->unix_domain = unix_domain;
+        client->id = ++last_client_id;
+        logInfo("Client connected", clientAddress(client->address, unix_domain),
+                { { "client", client->id } });
+        connect_hndl(*client);
+        client_mutex.lock();
+        client_list.emplace_back(std::move(client));
+        client_mutex.unlock();
+    } else {
+        shutdown(client_socket, 0);
+        close(client_socket);
+    }
+}
+
+/*!
+ * \brief Прием подключений через unix сокет.
+ *
+ * Клиенты на том же узле подключаются без TCP и могут перейти на разделяемую память.
+ *
+ * \param[in] path Путь к сокету.
+ * \return Состояние сокета.
+*/
+SocketStatus LedServer::listenUnix(const std::string& path) {
+    sockaddr_un address;
+
+    if (unix_socket != -1 || not makeUnixAddress(path, address))
+        return SocketStatus::err_socket_bind;
+
+    Socket sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return SocketStatus::err_socket_init;
+
+    unlink(path.c_str());
+    if (bind(sock, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0) {
+        close(sock);
+        return SocketStatus::err_socket_bind;
+    }
+    if (listen(sock, SOMAXCONN) < 0) {
+        close(sock);
+        return SocketStatus::err_socket_listening;
+    }
+
+    unix_path = path;
+    unix_socket = sock;
+    return SocketStatus::up;
+}
+
+/*!
+ * \brief Перевод клиента на разделяемую память.
+ *
+ * Сервер создает канал и передает его дескрипторы клиенту через unix сокет. Запрос
+ * должен быть первым сообщением клиента.
+ *
+ * \param[in] client Клиент.
+ * \return Статус операции.
+*/
+bool LedServer::attachShm(Client& client) {
+    static const char ATTACHED = 'S';
+
+    if (not client.unix_domain || client.shm)
+        return false;
+
+    std::shared_ptr<ShmChannel> channel = ShmChannel::create();
+    if (not channel || not sendFds(client._socket, &ATTACHED, sizeof(ATTACHED),
+                                   channel->fds()))
+        return false;
+
+    client.shm = channel;
+    return true;
+}
+
+/*!
+ * \brief Определение класса приоритета сообщения.
+ *
+ * \param[in] data Сообщение.
+ * \return write для set-*, read для остальных.
+*/
+static JobPriority classifyMessage(const DataBuffer& data) {
+    static const char SET_PREFIX[] = "set-";
+    static const char STREAM_PREFIX[] = "stream-";
+    const size_t size = sizeof(SET_PREFIX) - 1;
+    const size_t stream_size = sizeof(STREAM_PREFIX) - 1;
+
+    if (data.size() >= size && memcmp(data.data(), SET_PREFIX, size) == 0)
+        return JobPriority::write;
+    if (data.size() >= stream_size && memcmp(data.data(), STREAM_PREFIX, stream_size) == 0)
+        return JobPriority::write;
+    return JobPriority::read;
+}
+
+/*!
+ * \brief Проверка, что сообщение - фрагмент потоковой передачи.
+*/
+static bool isStreamChunk(const DataBuffer& data) {
+    const size_t size = sizeof(STREAM_DATA_PREFIX) - 1;
+    return data.size() >= size && memcmp(data.data(), STREAM_DATA_PREFIX, size) == 0;
+}
+
 /*!
  * \brief Задание на ожидание новых данных.
+ *
+ * Сокеты клиентов опрашиваются через poll, данные читаются только из готовых сокетов.
+ * Сообщения клиента обрабатываются через его strand в порядке поступления. Если
+ * очередь класса приоритета заполнена, клиенту отвечается "BUSY".
 */
 void LedServer::waitingDataLoop() {
     {
+        std::shared_lock loop_lock(loop_mtx, std::try_to_lock);
+        if (not loop_lock.owns_lock() || handing_off)
+            return;
+
+        std::vector<pollfd> fds;
+        {
+            std::lock_guard lock(client_mutex);
+            for (auto& client : client_list) {
+                if (not client || client->_status != SocketStatus::connected)
+                    continue;
+                fds.push_back({ client->_socket, POLLIN, 0 });
+                if (client->shm)
+                    fds.push_back({ client->shm->eventFd(), POLLIN, 0 });
+            }
+        }
+
+        // Клиенты, отключившиеся без данных (например, в обработчике), тоже
+        // просматриваются, поэтому результат poll не проверяется
+        poll(fds.data(), fds.size(), loopPollTimeout());
         std::lock_guard lock(client_mutex);
 
         for (auto& client : client_list) {
-            if (not client)
+            if (not client || client->disconnect_posted)
+                continue;
+            if (client->_status != SocketStatus::connected) {
+                postDisconnect(client);
                 continue;
-            if (DataBuffer data = client->loadData(); not data.empty()) {
-                thread_pool.addJob(
-                    [this, _data = std::move(data), &client] {
-                        client->access_mtx.lock();
+            }
+            int event_fd = client->shm ? client->shm->eventFd() : -1;
+            auto ready = std::find_if(fds.begin(), fds.end(),
+                [&client, event_fd](const pollfd& pfd) {
+                    return (pfd.fd == client->_socket || pfd.fd == event_fd) &&
+                           pfd.revents;
+                });
+            if (ready == fds.end())
+                continue;
+            DataBuffer data = client->loadData();
+            if (not client->shm && client->unix_domain &&
+                    data.size() == sizeof(SHM_ATTACH_REQUEST) - 1 &&
+                    memcmp(data.data(), SHM_ATTACH_REQUEST, data.size()) == 0) {
+                if (not attachShm(*client))
+                    client->disconnect();
+                data.clear();
+                if (client->_status == SocketStatus::connected)
+                    continue;
+            }
+            // Клиент, превысивший окно потоковой передачи, нарушает протокол
+            size_t chunk = isStreamChunk(data) ? data.size() : 0;
+            if (chunk && (client->stream_inflight += chunk) > stream_window) {
+                client->disconnect();
+                data.clear();
+            }
+            if (not data.empty()) {
+                capture.record(client->id, data);
+                JobPriority priority = classifyMessage(data);
+                uint64_t queued = tracingEnabled() ? traceNow() : 0;
+                bool accepted = client->strand->post(
+                    [this, _data = std::move(data), &client, queued, chunk] {
+                        TraceRequest request(queued ? traceNextRequest() : 0);
+                        if (queued)
+                            traceSpan("queue", queued, traceNow());
+                        std::unique_lock access_lock(client->access_mtx, std::defer_lock);
+                        {
+                            TraceScope lock_span("lock");
+                            access_lock.lock();
+                        }
+                        TraceScope handler_span("handler");
+                        // Фрагмент уходит из окна до ответа, иначе следующий,
+                        // отправленный по этому ответу, может его превысить
+                        client->stream_inflight -= chunk;
+                        logDebug("Command", std::string_view(
+                                     reinterpret_cast<const char*>(_data.data()),
+                                     _data.size()),
+                                 { { "client", client->id } });
                         if (handler) handler(std::move(_data), *client);
                         else server_business(std::move(_data), *client);
-                        client->access_mtx.unlock();
-                    }
-                );
-            } else if (client->_status == mega_camera::SocketStatus::disconnected) {
-                thread_pool.addJob(
-                    [this, &client] {
-                        if (not client) return;
-                        client->access_mtx.lock();
-                        Client* pointer = client.release();
-                        client = nullptr;
-                        pointer->access_mtx.unlock();
-                        disconnect_hndl(*pointer);
-                        client_list.erase(
-                            std::remove(client_list.begin(), client_list.end(), client),
-                            client_list.end());
-                        delete pointer;
-                    }
+                    }, priority
                 );
+                // Отказ встает в очередь клиента, чтобы не обогнать прежние ответы
+                if (not accepted && chunk)
+                    client->stream_inflight -= chunk;
+                if (not accepted)
+                    client->strand->post(
+                        [&client] { client->sendData("BUSY\n"); },
+                        JobPriority::control, true);
+            } else if (client->_status != SocketStatus::connected) {
+                postDisconnect(client);
             }
         }
     }
 
-    if (_status == SocketStatus::up) {
-        while (client_list.size() == 0) {
-            //! Сон, когда нет клиентов
-            if (_status == SocketStatus::close)
-                return;
-            sleep(1);
-        }
-        thread_pool.addJob([this]() {
+    if (_status == SocketStatus::up && not handing_off)
+        loopPool().addJob([this]() {
             waitingDataLoop();
         });
-    }
+}
+
+/*!
+ * \brief Постановка отключения клиента в его очередь, под client_mutex.
+ *
+ * Отключение встает после сообщений клиента и принимается даже при заполненной
+ * очереди, иначе клиент, его сокет и strand остались бы до остановки сервера.
+ * Ставится один раз.
+*/
+void LedServer::postDisconnect(std::unique_ptr<Client>& client) {
+    client->disconnect_posted = true;
+    client->strand->post(
+        [this, &client] {
+            Client* pointer;
+            {
+                // Элемент списка читают циклы и stop() под той же блокировкой
+                std::lock_guard list_lock(client_mutex);
+                if (not client) return;
+                pointer = client.release();
+                // remove_if списка не перемещает элементы между узлами
+                client_list.remove_if(
+                    [](const std::unique_ptr<Client>& cl) { return not cl; });
+            }
+            logInfo("Client disconnected",
+                    clientAddress(pointer->address, pointer->unix_domain),
+                    { { "client", pointer->id } });
+            disconnect_hndl(*pointer);
+            delete pointer;
+        }, JobPriority::control, true
+    );
 }
 
 /*!
@@ -203,6 +543,22 @@ LedServer::Client::disconnect() {
     return _status;
 }
 
+/*!
+ * \brief Освобождение сокета без shutdown.
+ *
+ * Используется после передачи сокета другому процессу: соединение остается открытым
+ * у преемника, закрывается только локальный дескриптор.
+*/
+void LedServer::Client::detach() {
+    _status = mega_camera::SocketStatus::disconnected;
+
+    if (_socket == -1)
+        return;
+
+    close(_socket);
+    _socket = -1;
+}
+
 LedServer::LedServer(
     const uint16_t _port
     , KeepAliveConfig _ka_conf
@@ -210,21 +566,45 @@ LedServer::LedServer(
     , con_handler_function_t _connect_hndl
     , con_handler_function_t _disconnect_hndl
     , uint _thread_count
+    , PlacementConfig _placement
 ) : serv_socket(-1)
-    , thread_pool(_thread_count)
+    , thread_pool(_thread_count,
+                  _placement.worker_cpus.empty() && _placement.numa_node >= 0
+                  ? nodeCpuList(_placement.numa_node) : _placement.worker_cpus,
+                  _placement.numa_local)
+    , io_pool(_placement.io_cpus.empty() ? nullptr
+              : new ThreadPool(IO_THREAD_COUNT, _placement.io_cpus,
+                               _placement.numa_local))
+    , unix_path()
+    , udp_sequence()
+    , replication_thread()
+    , replication_mtx()
+    , replication_condition()
+    , primary_host()
+    , primary_client()
+    , forward_mtx()
+    , forward_pending()
+    , upgrade_path()
+    , upgrade_thread()
+    , loop_mtx()
     , port(_port)
     , handler(_handler)
     , connect_hndl(_connect_hndl)
     , disconnect_hndl(_disconnect_hndl)
     , ka_conf(_ka_conf)
     , client_list()
-    , client_mutex()
+    , client_mutex("server.client_list")
+    , capture()
+    , stream_hndl()
 {}
 
 
 LedServer::Client::Client(Socket psocket,
-                          SocketAddr_in _address)
-    : access_mtx(), address(_address) {
+                          SocketAddr_in _address,
+                          ThreadPool& pool)
+    : access_mtx("client.access"), address(_address)
+    , strand(std::make_shared<Strand>(pool))
+    , streams() {
     _socket = psocket;
     _status = SocketStatus::connected;
 }
@@ -232,6 +612,13 @@ LedServer::Client::Client(Socket psocket,
 LedServer::~LedServer() {
     if (_status == SocketStatus::up)
         stop();
+    stopReplication();
+    if (upgrade_thread.joinable()) {
+        if (upgrade_thread.get_id() == std::this_thread::get_id())
+            upgrade_thread.detach();
+        else
+            upgrade_thread.join();
+    }
 }
 
 LedServer::Client::~Client() {
@@ -0,0 +1,223 @@
+/*!
+ * \brief Реализация канала через разделяемую память.
+*/
+#include "shm_channel.h"
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+using namespace mega_camera;
+
+//! Размер области одного кольца: заголовок и данные.
+static const size_t SHM_RING_AREA = sizeof(ShmRing) + SHM_RING_SIZE;
+
+static void futexWait(std::atomic<uint32_t>* addr, uint32_t expected, long timeout_ns) {
+    timespec timeout = { 0, timeout_ns };
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+static void futexWake(std::atomic<uint32_t>* addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+static uint8_t* ringData(ShmRing* ring) {
+    return reinterpret_cast<uint8_t*>(ring + 1);
+}
+
+static void ringWrite(ShmRing* ring, uint32_t capacity, uint32_t pos, const void* src,
+                      uint32_t size) {
+    uint32_t offset = pos & (capacity - 1);
+    uint32_t first = std::min(size, capacity - offset);
+    memcpy(ringData(ring) + offset, src, first);
+    memcpy(ringData(ring), static_cast<const uint8_t*>(src) + first, size - first);
+}
+
+static void ringRead(ShmRing* ring, uint32_t capacity, uint32_t pos, void* dst,
+                     uint32_t size) {
+    uint32_t offset = pos & (capacity - 1);
+    uint32_t first = std::min(size, capacity - offset);
+    memcpy(dst, ringData(ring) + offset, first);
+    memcpy(static_cast<uint8_t*>(dst) + first, ringData(ring), size - first);
+}
+
+ShmChannel::ShmChannel(int _memfd, int _c2s_event, int _s2c_event, bool _server_side)
+    : memfd(_memfd)
+    , c2s_event(_c2s_event)
+    , s2c_event(_s2c_event)
+    , mapping(MAP_FAILED)
+    , mapping_size(2 * SHM_RING_AREA)
+    , rx(nullptr)
+    , tx(nullptr)
+    , rx_event(_server_side ? _c2s_event : _s2c_event)
+    , tx_event(_server_side ? _s2c_event : _c2s_event)
+    , capacity(SHM_RING_SIZE)
+    , server_side(_server_side)
+    , send_mtx() {
+    mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mapping == MAP_FAILED)
+        return;
+
+    ShmRing* c2s = static_cast<ShmRing*>(mapping);
+    ShmRing* s2c = reinterpret_cast<ShmRing*>(static_cast<uint8_t*>(mapping) + SHM_RING_AREA);
+    rx = server_side ? c2s : s2c;
+    tx = server_side ? s2c : c2s;
+}
+
+ShmChannel::~ShmChannel() {
+    if (mapping != MAP_FAILED)
+        munmap(mapping, mapping_size);
+    for (int fd : { memfd, c2s_event, s2c_event })
+        if (fd != -1)
+            close(fd);
+}
+
+/*!
+ * \brief Создание канала на стороне сервера.
+ *
+ * \return Канал или nullptr.
+*/
+std::shared_ptr<ShmChannel> ShmChannel::create() {
+    int fd = memfd_create("ledctrl-shm", MFD_CLOEXEC);
+    if (fd == -1)
+        return nullptr;
+    if (ftruncate(fd, static_cast<off_t>(2 * SHM_RING_AREA)) == -1) {
+        close(fd);
+        return nullptr;
+    }
+
+    int c2s = eventfd(0, EFD_CLOEXEC);
+    int s2c = eventfd(0, EFD_CLOEXEC);
+    std::shared_ptr<ShmChannel> channel = attach(fd, c2s, s2c, true);
+    if (not channel)
+        return nullptr;
+
+    // Память memfd обнулена. Емкости записываются для наглядности, каналы их не читают
+    channel->rx->capacity = SHM_RING_SIZE;
+    channel->tx->capacity = SHM_RING_SIZE;
+    return channel;
+}
+
+/*!
+ * \brief Подключение к существующему каналу.
+ *
+ * Канал становится владельцем дескрипторов, в том числе при ошибке.
+ *
+ * \return Канал или nullptr.
+*/
+std::shared_ptr<ShmChannel> ShmChannel::attach(int fd, int c2s, int s2c,
+                                               bool server_side) {
+    std::shared_ptr<ShmChannel> channel(new ShmChannel(fd, c2s, s2c, server_side));
+    if (fd == -1 || c2s == -1 || s2c == -1 || channel->mapping == MAP_FAILED)
+        return nullptr;
+    return channel;
+}
+
+/*!
+ * \brief Отправка сообщения.
+ *
+ * \param[in] data Данные.
+ * \param[in] size Размер.
+ * \return false, если сообщение не помещается или место не освободилось за
+ * SHM_SEND_TIMEOUT.
+*/
+bool ShmChannel::send(const void* data, uint32_t size) {
+    const uint32_t need = static_cast<uint32_t>(sizeof(uint32_t)) + size;
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(SHM_SEND_TIMEOUT);
+
+    if (need > capacity)
+        return false;
+
+    std::lock_guard lock(send_mtx);
+    uint32_t head = tx->head.load(std::memory_order_relaxed);
+
+    for (;;) {
+        uint32_t tail = tx->tail.load(std::memory_order_acquire);
+        if (head - tail <= capacity && capacity - (head - tail) >= need)
+            break;
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        tx->writer_waiting.store(1);
+        if (tx->tail.load() != tail)
+            continue;
+        futexWait(&tx->tail, tail, 10000000);
+    }
+
+    ringWrite(tx, capacity, head, &size, sizeof(size));
+    ringWrite(tx, capacity, head + static_cast<uint32_t>(sizeof(size)), data, size);
+    tx->head.store(head + need, std::memory_order_release);
+
+    uint64_t one = 1;
+    return write(tx_event, &one, sizeof(one)) == sizeof(one);
+}
+
+/*!
+ * \brief Прием сообщения.
+ *
+ * На стороне клиента ожидает данные или разрыв управляющего сокета, на стороне
+ * сервера не блокируется.
+ *
+ * \param[in] control Управляющий unix сокет.
+ * \param[out] closed Соединение разорвано.
+ * \return Сообщение, .size() == 0 если данных нет.
+*/
+DataBuffer ShmChannel::receive(Socket control, bool& closed) {
+    closed = false;
+
+    for (;;) {
+        uint32_t tail = rx->tail.load(std::memory_order_relaxed);
+        uint32_t head = rx->head.load(std::memory_order_acquire);
+
+        if (head != tail) {
+            // head пишет другая сторона: неверные счетчики или длина - разрыв
+            uint32_t size = 0;
+            if (head - tail >= sizeof(size) && head - tail <= capacity)
+                ringRead(rx, capacity, tail, &size, sizeof(size));
+            if (head - tail < sizeof(size) || head - tail > capacity ||
+                    size > MAX_MESSAGE_SIZE || size > head - tail - sizeof(size)) {
+                closed = true;
+                return DataBuffer();
+            }
+            DataBuffer buffer(size);
+            ringRead(rx, capacity, tail + static_cast<uint32_t>(sizeof(size)), buffer.data(),
+                     size);
+            rx->tail.store(tail + static_cast<uint32_t>(sizeof(size)) + size,
+                           std::memory_order_release);
+            if (rx->writer_waiting.exchange(0))
+                futexWake(&rx->tail);
+            return buffer;
+        }
+
+        pollfd fds[2] = { { rx_event, POLLIN, 0 }, { control, POLLIN, 0 } };
+        if (poll(fds, 2, server_side ? 0 : -1) < 0 && errno != EINTR) {
+            closed = true;
+            return DataBuffer();
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(rx_event, &count, sizeof(count)) == sizeof(count))
+                continue;
+        }
+
+        if (fds[1].revents) {
+            char byte;
+            ssize_t answ = recv(control, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+            if (answ == 0 || (answ < 0 && errno != EAGAIN)) {
+                closed = true;
+                return DataBuffer();
+            }
+        }
+
+        if (server_side)
+            return DataBuffer();
+    }
+}
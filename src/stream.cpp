@@ -0,0 +1,163 @@
+/*!
+ * \brief Потоковая передача больших данных.
+ *
+ * Данные больше MAX_MESSAGE_SIZE передаются фрагментами:
+ *
+ *     stream-open <размер>         -> OK <номер> <окно>
+ *     stream-data <номер> <байты>  -> OK <принято> [<контрольная сумма>]
+ *     stream-close <номер>         -> OK
+ *
+ * Каждый фрагмент обрабатывается по мере поступления и освобождается, ответ на него
+ * подтверждает принятые байты. Клиент держит без подтверждения не больше окна (в
+ * байтах кадров stream-data на подключение), поэтому память сервера на передачу
+ * ограничена окном независимо от размера данных. Последний фрагмент подтверждается
+ * контрольной суммой FNV-1a всех данных.
+*/
+#include "server_base.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+
+using namespace mega_camera;
+
+static const char STREAM_OPEN_PREFIX[] = "stream-open ";
+static const char STREAM_CLOSE_PREFIX[] = "stream-close ";
+
+/*!
+ * \brief Продолжение контрольной суммы FNV-1a.
+*/
+static uint32_t checksum(uint32_t hash, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*!
+ * \brief Проверка префикса сообщения.
+*/
+static bool hasPrefix(const DataBuffer& data, const char* prefix, size_t size) {
+    return data.size() >= size && memcmp(data.data(), prefix, size) == 0;
+}
+
+/*!
+ * \brief Разбор десятичного числа.
+ *
+ * \param[in,out] pos Позиция в сообщении, после разбора - за числом и пробелом.
+ * \param[in] end Конец сообщения.
+ * \param[out] value Число.
+ * \return Число разобрано.
+*/
+static bool parseNumber(const uint8_t*& pos, const uint8_t* end, uint64_t& value) {
+    const uint8_t* begin = pos;
+
+    value = 0;
+    while (pos != end && *pos >= '0' && *pos <= '9' && pos - begin < 19)
+        value = value * 10 + static_cast<uint64_t>(*pos++ - '0');
+    if (pos == begin || (pos != end && *pos != ' ' && *pos != '\n'))
+        return false;
+    if (pos != end)
+        ++pos;
+    return true;
+}
+
+/*!
+ * \brief Размер окна потоковой передачи.
+ *
+ * \param[in] window Байты кадров stream-data без подтверждения на подключение, не
+ * меньше MAX_MESSAGE_SIZE.
+*/
+void LedServer::setStreamWindow(size_t window) {
+    stream_window = std::max(window, MAX_MESSAGE_SIZE);
+}
+
+/*!
+ * \brief Установка обработчика фрагментов.
+ *
+ * Обработчик вызывается в очереди клиента для каждого фрагмента; false прерывает
+ * передачу.
+*/
+void LedServer::setStreamHandler(stream_handler_function_t _stream_hndl) {
+    stream_hndl = _stream_hndl;
+}
+
+/*!
+ * \brief Обработка команд потоковой передачи.
+ *
+ * Вызывается под access_mtx клиента.
+ *
+ * \param[in] data Сообщение.
+ * \param[in] client Клиент.
+ * \return false, если сообщение не относится к потоковой передаче.
+*/
+bool LedServer::streamBusiness(const DataBuffer& data, Client& client) {
+    const uint8_t* end = data.data() + data.size();
+    uint64_t value;
+
+    if (hasPrefix(data, STREAM_DATA_PREFIX, sizeof(STREAM_DATA_PREFIX) - 1)) {
+        const uint8_t* pos = data.data() + sizeof(STREAM_DATA_PREFIX) - 1;
+
+        auto it = client.streams.end();
+        if (parseNumber(pos, end, value))
+            it = client.streams.find(static_cast<uint32_t>(value));
+        if (it == client.streams.end()) {
+            client.sendData("FAILED\n");
+            return true;
+        }
+
+        StreamTransfer& transfer = (*it).second;
+        size_t size = static_cast<size_t>(end - pos);
+        if (size > transfer.size - transfer.received) {
+            client.streams.erase(it);
+            client.sendData("FAILED\n");
+            return true;
+        }
+
+        transfer.checksum = checksum(transfer.checksum, pos, size);
+        transfer.received += size;
+        bool last = transfer.received == transfer.size;
+        if (stream_hndl && not stream_hndl(client, (*it).first, pos, size, last)) {
+            client.streams.erase(it);
+            client.sendData("FAILED\n");
+            return true;
+        }
+
+        char reply[64];
+        if (last)
+            snprintf(reply, sizeof(reply), "OK %" PRIu64 " %08" PRIx32 "\n",
+                     transfer.received, transfer.checksum);
+        else
+            snprintf(reply, sizeof(reply), "OK %" PRIu64 "\n", transfer.received);
+        if (last)
+            client.streams.erase(it);
+        client.sendData(reply);
+        return true;
+    }
+
+    if (hasPrefix(data, STREAM_OPEN_PREFIX, sizeof(STREAM_OPEN_PREFIX) - 1)) {
+        const uint8_t* pos = data.data() + sizeof(STREAM_OPEN_PREFIX) - 1;
+        if (not parseNumber(pos, end, value) || value == 0 ||
+                client.streams.size() >= STREAM_MAX_PER_CLIENT) {
+            client.sendData("FAILED\n");
+            return true;
+        }
+
+        uint32_t id = ++client.last_stream;
+        client.streams[id] = { value, 0, 2166136261u };
+        client.sendData("OK " + std::to_string(id) + " " +
+                        std::to_string(stream_window.load()) + "\n");
+        return true;
+    }
+
+    if (hasPrefix(data, STREAM_CLOSE_PREFIX, sizeof(STREAM_CLOSE_PREFIX) - 1)) {
+        const uint8_t* pos = data.data() + sizeof(STREAM_CLOSE_PREFIX) - 1;
+        bool closed = parseNumber(pos, end, value) &&
+                      client.streams.erase(static_cast<uint32_t>(value)) > 0;
+        client.sendData(closed ? "OK\n" : "FAILED\n");
+        return true;
+    }
+
+    return false;
+}
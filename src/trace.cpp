@@ -0,0 +1,195 @@
+/*!
+ * \brief Реализация трассировки запросов.
+*/
+#include "trace.h"
+
+#ifdef LEDCTRL_TRACING
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace mega_camera;
+
+std::atomic<bool> mega_camera::trace_enabled = false;
+
+namespace {
+
+//! Участок.
+struct TraceEvent {
+    uint64_t begin;
+    uint64_t end;
+    uint64_t request;
+    const char* name;
+    //! Поток, записавший участок: кольцо переходит к другому потоку.
+    long tid;
+};
+
+/*!
+ * \brief Кольцо участков одного потока.
+ *
+ * Пишет только поток-владелец, без блокировок: событие записывается в ячейку, затем
+ * head публикуется с release. Выгрузка читает head до и после копирования и
+ * отбрасывает ячейки, которые владелец мог перезаписать за это время. Кольцо
+ * завершившегося потока переходит к новому потоку вместе с участками.
+*/
+struct TraceRing {
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<bool> owned;
+    TraceEvent events[TRACE_RING_SIZE];
+};
+
+//! Кольца потоков, писавших участки. Кольца живут до конца процесса.
+std::mutex rings_mtx;
+std::vector<std::unique_ptr<TraceRing>> rings;
+std::atomic<uint64_t> last_request = 0;
+thread_local uint64_t current_request = 0;
+
+//! Кольцо потока, отдается при завершении потока.
+struct LocalRing {
+    TraceRing* ring = nullptr;
+    long tid = 0;
+
+    ~LocalRing() {
+        if (ring)
+            ring->owned.store(false, std::memory_order_release);
+    }
+};
+
+thread_local LocalRing local_ring;
+
+/*!
+ * \brief Кольцо текущего потока.
+ *
+ * Берет свободное кольцо или создает новое, поэтому при смене потоков пула число
+ * колец не растет.
+*/
+TraceRing* localRing() {
+    if (local_ring.ring)
+        return local_ring.ring;
+
+    local_ring.tid = syscall(SYS_gettid);
+    std::lock_guard lock(rings_mtx);
+    for (auto& ring : rings)
+        if (not ring->owned.exchange(true, std::memory_order_acquire))
+            return local_ring.ring = ring.get();
+
+    std::unique_ptr<TraceRing> ring(new TraceRing());
+    ring->head = 0;
+    ring->owned = true;
+    local_ring.ring = ring.get();
+    rings.push_back(std::move(ring));
+    return local_ring.ring;
+}
+
+}
+
+/*!
+ * \brief Включение и выключение записи участков.
+*/
+void mega_camera::setTracing(bool enabled) {
+    trace_enabled = enabled;
+}
+
+/*!
+ * \brief Текущее время трассировки, нс. Не равно 0.
+*/
+uint64_t mega_camera::traceNow() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count()) | 1;
+}
+
+/*!
+ * \brief Номер нового запроса.
+*/
+uint64_t mega_camera::traceNextRequest() {
+    return ++last_request;
+}
+
+/*!
+ * \brief Запись участка в кольцо текущего потока.
+*/
+void mega_camera::traceSpan(const char* name, uint64_t begin, uint64_t end) {
+    TraceRing* ring = localRing();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+    ring->events[head & (TRACE_RING_SIZE - 1)] = {
+        begin, end, current_request, name, local_ring.tid
+    };
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+TraceRequest::TraceRequest(uint64_t request)
+    : previous(current_request) {
+    current_request = request;
+}
+
+TraceRequest::~TraceRequest() {
+    current_request = previous;
+}
+
+/*!
+ * \brief Выгрузка участков в формате Chrome trace event JSON.
+ *
+ * Выгружаются последние TRACE_RING_SIZE участков каждого потока. Запись участков
+ * на время выгрузки не останавливается.
+ *
+ * \param[in] path Путь к файлу.
+ * \return Статус операции.
+*/
+bool mega_camera::traceDump(const std::string& path) {
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard lock(rings_mtx);
+        for (const auto& ring : rings) {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+            std::vector<TraceEvent> copy;
+            for (uint64_t i = first; i < head; ++i)
+                copy.push_back(ring->events[i & (TRACE_RING_SIZE - 1)]);
+
+            // Ячейки, перезаписанные во время копирования, отбрасываются. Ячейку
+            // after владелец может писать прямо сейчас, а она совпадает с
+            // after - TRACE_RING_SIZE. Барьер не дает чтению head обогнать копирование.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = ring->head.load(std::memory_order_relaxed);
+            uint64_t valid = after + 1 > TRACE_RING_SIZE ? after + 1 - TRACE_RING_SIZE : 0;
+            for (uint64_t i = std::max(first, valid); i < head; ++i)
+                events.push_back(copy[i - first]);
+        }
+    }
+
+    std::sort(events.begin(), events.end(),
+        [](const auto& left, const auto& right) {
+            return left.begin < right.begin;
+        });
+
+    FILE* file = fopen(path.c_str(), "we");
+    if (not file)
+        return false;
+
+    uint64_t origin = events.empty() ? 0 : events.front().begin;
+    int pid = getpid();
+    fprintf(file, "{\"traceEvents\":[");
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent& event = events[i];
+        fprintf(file,
+                "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,"
+                "\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%" PRIu64 "}}",
+                i ? "," : "", event.name, pid, event.tid,
+                static_cast<double>(event.begin - origin) / 1000.0,
+                static_cast<double>(event.end - event.begin) / 1000.0, event.request);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    return fclose(file) == 0;
+}
+
+#endif // LEDCTRL_TRACING
@@ -0,0 +1,169 @@
+/*!
+ * \brief Быстрый путь UDP для частых обновлений.
+ *
+ * Контроллеры анимации шлют set-* сотни раз в секунду, и важно только последнее
+ * значение. Датаграмма: номер (uint64_t, сетевой порядок байтов) и команда set-* в
+ * текстовом виде. Датаграммы читаются пачками через recvmmsg, устаревшие и пришедшие
+ * не по порядку отбрасываются, внутри пачки для каждой пары команда/устройство
+ * применяется только последнее значение. Ответ не отправляется.
+*/
+#include "server_base.h"
+
+#include <endian.h>
+
+#include <cstring>
+#include <mutex>
+
+using namespace mega_camera;
+
+/*!
+ * \brief Включение приема обновлений по UDP.
+ *
+ * Вызывается до start(). Сокет опрашивается циклом приема соединений.
+ *
+ * \param[in] udp_port Порт.
+ * \return Состояние сокета.
+*/
+SocketStatus LedServer::enableUdp(const uint16_t udp_port) {
+    int flag{true};
+    SocketAddr_in address;
+
+    if (udp_socket != -1)
+        return SocketStatus::err_socket_bind;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(udp_port);
+    address.sin_family = AF_INET;
+
+    Socket sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return SocketStatus::err_socket_init;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) == -1 ||
+            bind(sock, reinterpret_cast<struct sockaddr*>(&address),
+                 sizeof(address)) < 0) {
+        close(sock);
+        return SocketStatus::err_socket_bind;
+    }
+
+    udp_socket = sock;
+    return SocketStatus::up;
+}
+
+/*!
+ * \brief Счетчики быстрого пути UDP.
+*/
+UdpStats LedServer::getUdpStats() const {
+    return { udp_received, udp_applied, udp_stale, udp_coalesced, udp_rejected };
+}
+
+/*!
+ * \brief Ключ объединения: команда и номер устройства.
+ *
+ * Команды без номера относятся к устройству 0, как и в set-* по TCP.
+*/
+static std::string coalesceKey(const std::string& command) {
+    size_t com = command.find_first_of(" ");
+    std::string key = command.substr(0, com);
+
+    if (com != std::string::npos && command.compare(com + 1, 1, "#") == 0)
+        key += command.substr(com, command.find_first_of(" \n", com + 1) - com);
+    else
+        key += " #0";
+    return key;
+}
+
+/*!
+ * \brief Применение пачки датаграмм.
+ *
+ * \param[in] batch Пары отправитель/датаграмма в порядке получения.
+*/
+void LedServer::applyDatagrams(
+        const std::vector<std::pair<uint64_t, std::string>>& batch) {
+    std::vector<std::string> commands;
+    std::unordered_map<std::string, size_t> latest;
+
+    for (const auto& [sender, datagram] : batch) {
+        uint64_t sequence;
+        if (datagram.size() <= sizeof(sequence)) {
+            ++udp_rejected;
+            continue;
+        }
+        memcpy(&sequence, datagram.data(), sizeof(sequence));
+        sequence = be64toh(sequence);
+
+        // Номер 0 начинает новую серию, например после перезапуска отправителя
+        auto last = udp_sequence.find(sender);
+        if (last != udp_sequence.end() && sequence != 0 && sequence <= last->second) {
+            ++udp_stale;
+            continue;
+        }
+        if (last == udp_sequence.end() && udp_sequence.size() >= UDP_MAX_SENDERS)
+            udp_sequence.clear();
+        udp_sequence[sender] = sequence;
+
+        std::string command = datagram.substr(sizeof(sequence));
+        if (command.compare(0, 4, "set-") != 0) {
+            ++udp_rejected;
+            continue;
+        }
+
+        auto [slot, inserted] = latest.emplace(coalesceKey(command), commands.size());
+        if (inserted) {
+            commands.push_back(std::move(command));
+        } else {
+            commands[slot->second] = std::move(command);
+            ++udp_coalesced;
+        }
+    }
+
+    for (const auto& command : commands) {
+        if (applyUpdate(command))
+            ++udp_applied;
+        else
+            ++udp_rejected;
+    }
+}
+
+/*!
+ * \brief Прием готовых датаграмм.
+ *
+ * Вызывается из цикла приема соединений, когда UDP сокет готов к чтению. За один
+ * вызов recvmmsg читается до UDP_BATCH датаграмм.
+*/
+void LedServer::receiveDatagrams() {
+    static thread_local std::vector<uint8_t> buffers(UDP_BATCH * UDP_DATAGRAM_SIZE);
+    mmsghdr messages[UDP_BATCH];
+    iovec vectors[UDP_BATCH];
+    SocketAddr_in addresses[UDP_BATCH];
+
+    memset(messages, 0, sizeof(messages));
+    for (uint i = 0; i < UDP_BATCH; ++i) {
+        vectors[i] = { buffers.data() + i * UDP_DATAGRAM_SIZE, UDP_DATAGRAM_SIZE };
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+    }
+
+    int count = recvmmsg(udp_socket, messages, UDP_BATCH, MSG_DONTWAIT, nullptr);
+    if (count <= 0)
+        return;
+
+    std::vector<std::pair<uint64_t, std::string>> batch;
+    batch.reserve(static_cast<size_t>(count));
+    for (int i = 0; i < count; ++i) {
+        // Обрезанная датаграмма не применяется
+        if (messages[i].msg_hdr.msg_flags & MSG_TRUNC)
+            continue;
+        uint64_t sender =
+            static_cast<uint64_t>(ntohl(addresses[i].sin_addr.s_addr)) << 16 |
+            ntohs(addresses[i].sin_port);
+        const char* data = reinterpret_cast<const char*>(vectors[i].iov_base);
+        batch.emplace_back(sender, std::string(data, messages[i].msg_len));
+    }
+    udp_received += static_cast<uint64_t>(count);
+    udp_rejected += static_cast<uint64_t>(count) - batch.size();
+    applyDatagrams(batch);
+}
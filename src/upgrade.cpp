@@ -0,0 +1,386 @@
+/*!
+ * \brief Горячее обновление сервера.
+ *
+ * Старый процесс передает новому слушающие сокеты (TCP, unix, UDP, репликации),
+ * сокеты клиентов и состояние через unix сокет (SCM_RIGHTS). Слушающий сокет не
+ * закрывается ни на одном шаге, поэтому новые подключения во время обновления копятся
+ * в очереди listen и не отклоняются.
+ *
+ * Незавершенные потоковые передачи клиентов (Client::streams) не передаются: на
+ * следующие части преемник отвечает FAILED, клиент начинает передачу заново.
+*/
+#include "server_base.h"
+#include "fd_passing.h"
+#include "shm_channel.h"
+#include "logger.h"
+
+#include <mutex>
+#include <shared_mutex>
+
+using namespace mega_camera;
+
+//! Типы сообщений протокола передачи.
+enum UpgradeMessage : uint32_t {
+    UPGRADE_LISTENER = 1
+  , UPGRADE_UNIX_LISTENER
+  , UPGRADE_CLIENTS
+  , UPGRADE_SHM_CLIENT
+  , UPGRADE_STATE
+  , UPGRADE_DONE
+  , UPGRADE_UDP_LISTENER
+  , UPGRADE_ACK
+  , UPGRADE_COMMIT
+  , UPGRADE_REPLICATION_LISTENER
+};
+
+//! Заголовок сообщения протокола передачи.
+struct UpgradeHeader {
+    uint32_t kind;
+    uint32_t count;
+};
+
+/*!
+ * \brief Отправка сообщения протокола передачи.
+*/
+static bool sendUpgradeMessage(Socket peer, uint32_t kind, uint32_t count,
+                               const void* payload, size_t size,
+                               const std::vector<int>& fds) {
+    DataBuffer message(sizeof(UpgradeHeader) + size);
+    UpgradeHeader header = { kind, count };
+
+    memcpy(message.data(), &header, sizeof(header));
+    if (size)
+        memcpy(message.data() + sizeof(header), payload, size);
+    return sendFds(peer, message.data(), message.size(), fds);
+}
+
+/*!
+ * \brief Ожидание сообщения протокола передачи без данных.
+ *
+ * \param[in] peer Соединение.
+ * \param[in] kind Ожидаемый тип.
+ * \return false при другом сообщении, закрытии соединения или таймауте.
+*/
+static bool waitUpgradeMessage(Socket peer, uint32_t kind) {
+    pollfd pfd = { peer, POLLIN, 0 };
+    UpgradeHeader header;
+
+    if (poll(&pfd, 1, UPGRADE_CONFIRM_TIMEOUT) <= 0 || not (pfd.revents & POLLIN))
+        return false;
+    return recv(peer, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+           header.kind == kind;
+}
+
+/*!
+ * \brief Проверка, что сокет принадлежит семейству AF_UNIX.
+*/
+static bool isUnixSocket(Socket sock) {
+    sockaddr_storage address;
+    SockLen_t len = sizeof(address);
+
+    if (getsockname(sock, reinterpret_cast<struct sockaddr*>(&address), &len) != 0)
+        return false;
+    return address.ss_family == AF_UNIX;
+}
+
+/*!
+ * \brief Включение приема запросов на горячее обновление.
+ *
+ * \param[in] path Путь к unix сокету.
+ * \return Состояние сокета.
+*/
+SocketStatus LedServer::enableUpgrade(const std::string& path) {
+    sockaddr_un address;
+
+    if (_status != SocketStatus::up || upgrade_thread.joinable())
+        return SocketStatus::err_socket_unused;
+    if (not makeUnixAddress(path, address))
+        return SocketStatus::err_socket_bind;
+
+    if ((upgrade_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+        return SocketStatus::err_socket_init;
+
+    unlink(path.c_str());
+    if (bind(upgrade_socket, reinterpret_cast<struct sockaddr*>(&address),
+             sizeof(address)) < 0 || listen(upgrade_socket, 1) < 0) {
+        close(upgrade_socket);
+        upgrade_socket = -1;
+        return SocketStatus::err_socket_bind;
+    }
+
+    upgrade_path = path;
+    upgrade_thread = std::thread(&LedServer::upgradeLoop, this);
+    return SocketStatus::up;
+}
+
+/*!
+ * \brief Ожидание преемника.
+ *
+ * После успешной передачи сервер останавливается. При ошибке передачи работа
+ * продолжается в прежнем режиме.
+*/
+void LedServer::upgradeLoop() {
+    while (_status == SocketStatus::up) {
+        pollfd pfd = { upgrade_socket, POLLIN, 0 };
+        if (poll(&pfd, 1, LOOP_POLL_TIMEOUT) <= 0 || not (pfd.revents & POLLIN))
+            continue;
+
+        Socket peer = accept4(upgrade_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (peer < 0)
+            continue;
+
+        if (handover(peer)) {
+            // Преемник займет путь после закрытия соединения
+            unlink(upgrade_path.c_str());
+            close(peer);
+            stop();
+            return;
+        }
+
+        close(peer);
+        // Несостоявшийся преемник мог уже заменить файл журнала своим снимком
+        if (not reopenJournal())
+            logError("Unable to reopen journal after failed handover");
+        handing_off = false;
+        startLoops();
+    }
+}
+
+/*!
+ * \brief Передача сокетов и состояния преемнику.
+ *
+ * Циклы приема останавливаются, уже принятые сообщения дообрабатываются, после чего
+ * сокеты передаются преемнику. Так ответы клиентам не переупорядочиваются.
+ *
+ * После UPGRADE_DONE преемник отвечает UPGRADE_ACK, когда все принял и готов
+ * работать, и ждет UPGRADE_COMMIT. Без подтверждения за UPGRADE_CONFIRM_TIMEOUT
+ * передача не состоялась и сервер продолжает работу сам.
+ *
+ * \param[in] peer Соединение с преемником.
+ * \return Статус операции.
+*/
+bool LedServer::handover(Socket peer) {
+    handing_off = true;
+    std::unique_lock loop_lock(loop_mtx);
+    thread_pool.waitIdle();
+
+    if (not sendUpgradeMessage(peer, UPGRADE_LISTENER, 1, nullptr, 0,
+                               { serv_socket }))
+        return false;
+    if (unix_socket != -1 &&
+            not sendUpgradeMessage(peer, UPGRADE_UNIX_LISTENER, 1, unix_path.data(),
+                                   unix_path.size(), { unix_socket }))
+        return false;
+    if (udp_socket != -1 &&
+            not sendUpgradeMessage(peer, UPGRADE_UDP_LISTENER, 1, nullptr, 0,
+                                   { udp_socket }))
+        return false;
+    // Ведомые переподключаются к преемнику и получают снимок
+    if (replication_socket != -1 &&
+            not sendUpgradeMessage(peer, UPGRADE_REPLICATION_LISTENER, 1, nullptr, 0,
+                                   { replication_socket }))
+        return false;
+
+    {
+        std::lock_guard lock(client_mutex);
+        std::vector<int> fds;
+        std::vector<SocketAddr_in> addresses;
+
+        for (auto it = client_list.begin(); it != client_list.end();) {
+            auto& client = *it++;
+            if (client && client->_status == SocketStatus::connected && client->shm) {
+                // Клиенту с каналом нужны еще memfd и eventfd, передается отдельно
+                std::vector<int> shm_fds = client->shm->fds();
+                shm_fds.insert(shm_fds.begin(), client->_socket);
+                if (not sendUpgradeMessage(peer, UPGRADE_SHM_CLIENT, 1, nullptr, 0, shm_fds))
+                    return false;
+            } else if (client && client->_status == SocketStatus::connected) {
+                fds.push_back(client->_socket);
+                addresses.push_back(client->address);
+            }
+            if (fds.size() == MAX_PASSED_FDS ||
+                    (it == client_list.end() && not fds.empty())) {
+                if (not sendUpgradeMessage(peer, UPGRADE_CLIENTS,
+                                           static_cast<uint32_t>(fds.size()),
+                                           addresses.data(),
+                                           addresses.size() * sizeof(SocketAddr_in), fds))
+                    return false;
+                fds.clear();
+                addresses.clear();
+            }
+        }
+    }
+
+    DataBuffer state = exportState();
+    if (not sendUpgradeMessage(peer, UPGRADE_STATE, 1, state.data(), state.size(), {}))
+        return false;
+    if (not sendUpgradeMessage(peer, UPGRADE_DONE, 0, nullptr, 0, {}) ||
+            not waitUpgradeMessage(peer, UPGRADE_ACK) ||
+            not sendUpgradeMessage(peer, UPGRADE_COMMIT, 0, nullptr, 0, {}))
+        return false;
+
+    handed_over = true;
+    return true;
+}
+
+/*!
+ * \brief Запуск сервера с сокетами предшественника.
+ *
+ * Журнал открывается после того, как предшественник передал состояние и перестал
+ * обрабатывать команды: сжатие заменяет файл журнала, и записи предшественника в
+ * замененный файл были бы потеряны.
+ *
+ * \param[in] path Путь к unix сокету предшественника.
+ * \param[in] journal_path Путь к журналу, пустой - без журнала.
+ * \return Состояние сокета.
+*/
+SocketStatus LedServer::takeover(const std::string& path, const std::string& journal_path) {
+    sockaddr_un address;
+    DataBuffer message;
+    std::vector<int> fds;
+    bool done = false;
+    bool imported = false;
+    Socket replication_listener = -1;
+
+    if (_status == SocketStatus::up)
+        return _status;
+    if (not makeUnixAddress(path, address))
+        return _status = SocketStatus::err_socket_connect;
+
+    Socket sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return _status = SocketStatus::err_socket_init;
+
+    if (connect(sock, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+        close(sock);
+        return _status = SocketStatus::err_socket_connect;
+    }
+
+    while (not done) {
+        UpgradeHeader header;
+
+        message.resize(sizeof(UpgradeHeader) + MAX_MESSAGE_SIZE);
+        if (recvFds(sock, message, fds) < static_cast<ssize_t>(sizeof(header)))
+            break;
+        memcpy(&header, message.data(), sizeof(header));
+        const uint8_t* payload = message.data() + sizeof(header);
+        size_t payload_size = message.size() - sizeof(header);
+
+        switch (header.kind) {
+        case UPGRADE_LISTENER:
+            if (fds.size() == 1) {
+                serv_socket = fds[0];
+                fds.clear();
+            }
+            break;
+        case UPGRADE_UNIX_LISTENER:
+            if (fds.size() == 1) {
+                unix_socket = fds[0];
+                unix_path.assign(reinterpret_cast<const char*>(payload), payload_size);
+                fds.clear();
+            }
+            break;
+        case UPGRADE_UDP_LISTENER:
+            if (fds.size() == 1 && udp_socket == -1) {
+                udp_socket = fds[0];
+                fds.clear();
+            }
+            break;
+        case UPGRADE_REPLICATION_LISTENER:
+            if (fds.size() == 1 && replication_listener == -1 && primary_host.empty()) {
+                replication_listener = fds[0];
+                fds.clear();
+            }
+            break;
+        case UPGRADE_SHM_CLIENT:
+            if (fds.size() == 4) {
+                SocketAddr_in client_addr;
+                memset(&client_addr, 0, sizeof(client_addr));
+                std::unique_ptr<Client> client(
+                    new Client(fds[0], client_addr, thread_pool));
+                client->unix_domain = true;
+                client->id = ++last_client_id;
+                client->shm = ShmChannel::attach(fds[1], fds[2], fds[3], true);
+                fds.clear();
+                std::lock_guard lock(client_mutex);
+                connect_hndl(*client);
+                client_list.emplace_back(std::move(client));
+            }
+            break;
+        case UPGRADE_CLIENTS:
+            if (fds.size() == header.count &&
+                    payload_size == header.count * sizeof(SocketAddr_in)) {
+                std::lock_guard lock(client_mutex);
+                for (size_t i = 0; i < fds.size(); ++i) {
+                    SocketAddr_in client_addr;
+                    memcpy(&client_addr, payload + i * sizeof(SocketAddr_in),
+                           sizeof(client_addr));
+                    std::unique_ptr<Client> client(
+                        new Client(fds[i], client_addr, thread_pool));
+                    client->unix_domain = isUnixSocket(fds[i]);
+                    client->id = ++last_client_id;
+                    connect_hndl(*client);
+                    client_list.emplace_back(std::move(client));
+                }
+                fds.clear();
+            }
+            break;
+        case UPGRADE_STATE:
+            imported = importState(DataBuffer(payload, payload + payload_size));
+            break;
+        case UPGRADE_DONE:
+            done = true;
+            break;
+        default:
+            break;
+        }
+
+        // Неожиданные дескрипторы не должны утекать
+        for (int fd : fds)
+            close(fd);
+    }
+
+    // Журнал сжимается в снимок принятого состояния, без повтора поверх него
+    if (not imported || serv_socket == -1 ||
+            (done && not journal_path.empty() && not openJournal(journal_path, false)))
+        done = false;
+
+    // Без UPGRADE_COMMIT предшественник продолжает работу со своими копиями сокетов
+    if (done && (not sendUpgradeMessage(sock, UPGRADE_ACK, 0, nullptr, 0, {}) ||
+                 not waitUpgradeMessage(sock, UPGRADE_COMMIT)))
+        done = false;
+
+    if (not done || serv_socket == -1) {
+        close(sock);
+        if (serv_socket != -1)
+            close(serv_socket);
+        if (unix_socket != -1)
+            close(unix_socket);
+        if (udp_socket != -1)
+            close(udp_socket);
+        if (replication_listener != -1)
+            close(replication_listener);
+        serv_socket = -1;
+        unix_socket = -1;
+        udp_socket = -1;
+        std::lock_guard lock(client_mutex);
+        for (auto& cl : client_list)
+            cl->detach();
+        client_list.clear();
+        return _status = SocketStatus::err_socket_read;
+    }
+
+    if (replication_listener != -1)
+        startReplication(replication_listener);
+
+    print_screen();
+    _status = SocketStatus::up;
+    startLoops();
+
+    // Предшественник закрывает соединение после освобождения пути
+    char byte;
+    while (recv(sock, &byte, sizeof(byte), 0) > 0) {}
+    close(sock);
+
+    return _status;
+}